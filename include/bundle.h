@@ -0,0 +1,160 @@
+#ifndef _BUNDLE_H_
+#define _BUNDLE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mutex.h"
+
+#define BUNDLE_MAGIC "XBUNDLE1"
+#define BUNDLE_VERSION 2
+#define BUNDLE_PAGE 4096
+#define BUNDLE_PATH_LEN 0xFF
+
+// precompressed variants a client accepts
+enum BUNDLE_ENCODING {
+    BUNDLE_IDENTITY,
+    BUNDLE_GZIP,
+    BUNDLE_BR,
+    BUNDLE_ENCODINGS
+};
+
+/*
+    On disk: header, displacement per bucket, entry index + 1 per slot,
+    entries, strings, then the bodies. Bodies of a page or more start on
+    a page, smaller ones are packed without crossing a page boundary.
+*/
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t buckets;
+    uint32_t slots;
+    uint64_t disp_offset;
+    uint64_t slot_offset;
+    uint64_t entry_offset;
+    uint64_t string_offset;
+    uint64_t string_size;
+    uint64_t size;
+};
+
+// each encoding is its own representation with its own ETag
+struct BundleBody {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t etag;
+};
+
+struct BundleEntry {
+    uint32_t path;
+    uint32_t type;
+    uint32_t last_modified;
+    int64_t mtime;
+    BundleBody body[BUNDLE_ENCODINGS];
+};
+
+// same hash-and-displace scheme as the MIME table, over 64 bit FNV-1a
+inline uint64_t bundle_hash(const char *path, int len) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline uint32_t bundle_slot(uint64_t h, uint32_t disp, uint32_t slots) {
+    h ^= disp * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h & (slots - 1);
+}
+
+class Bundle;
+
+// what a response needs from an entry, it holds a reference on the bundle
+struct BundleFile {
+    Bundle *bundle;
+    const char *address;
+    off_t offset;
+    off_t size;
+    time_t mtime;
+    const char *type;
+    const char *etag;
+    const char *last_modified;
+    const char *encoding;
+    bool vary;
+};
+
+class Bundle {
+  public:
+    static Bundle *open(const char *path);
+
+  public:
+    const BundleEntry *find(const char *path) const;
+
+    void fill(const BundleEntry *entry, int accept, BundleFile *file);
+
+    int fd() const { return m_fd; }
+
+    uint32_t count() const { return m_header->count; }
+
+    void ref();
+
+    void unref();
+
+  private:
+    Bundle();
+    ~Bundle();
+
+    bool check() const;
+
+    const char *string(uint32_t offset) const { return m_strings + offset; }
+
+  private:
+    int m_fd;
+    char *m_base;
+    size_t m_size;
+
+    const BundleHeader *m_header;
+    const uint32_t *m_disp;
+    const uint32_t *m_slots;
+    const BundleEntry *m_entries;
+    const char *m_strings;
+
+    int m_refs;
+    Mutex m_lock;
+};
+
+// the bundle being served, replaced whole on reload
+class BundleStore {
+  public:
+    BundleStore();
+    ~BundleStore();
+
+  public:
+    bool load(const char *path);
+
+    bool reload();
+
+    bool enabled() const { return m_current != NULL; }
+
+    // finds the normalized path, a hit keeps the bundle mapped until unref
+    bool lookup(const char *path, int accept, BundleFile *file);
+
+  private:
+    char m_path[BUNDLE_PATH_LEN];
+    Bundle *m_current;
+    Mutex m_lock;
+};
+
+// Accept-Encoding header value to a mask of BUNDLE_ENCODING bits
+int bundle_accept(const char *value);
+
+// If-None-Match header value against an entry ETag
+bool bundle_etag_match(const char *value, const char *etag);
+
+#endif
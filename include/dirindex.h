@@ -0,0 +1,110 @@
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "mutex.h"
+
+#define DIRINDEX_NAMES "index.html"
+#define DIRINDEX_CACHE_SIZE 256
+
+#define LISTING_HTML_TYPE "text/html; charset=utf-8"
+#define LISTING_JSON_TYPE "application/json"
+
+// a rendered directory listing, immutable once built, freed by the last unref
+class Listing {
+    friend class DirIndex;
+
+  public:
+    const char *data() const { return m_body.data(); }
+
+    off_t size() const { return m_body.size(); }
+
+    const char *type() const { return m_json ? LISTING_JSON_TYPE : LISTING_HTML_TYPE; }
+
+    const char *etag() const { return m_etag; }
+
+    void ref();
+
+    void unref();
+
+  private:
+    Listing();
+    ~Listing() {}
+
+  private:
+    dev_t m_dev;
+    ino_t m_ino;
+    struct timespec m_mtime;
+    bool m_json;
+    std::string m_path;
+
+    std::string m_body;
+    char m_etag[0x20];
+
+    int m_wd;
+    uint64_t m_used;
+
+    int m_refs;
+    Mutex m_lock;
+};
+
+/*
+    Index files are tried in order for a directory request. Without one,
+    and with listings on, the directory is read once and rendered as HTML
+    or JSON. The listing is cached by device, inode and format. A hit
+    needs the same mtime, and inotify drops a listing when an entry is
+    added, removed or rewritten. A directory changed within the last
+    second is rendered but not cached, because its mtime may not have
+    moved yet.
+*/
+class DirIndex {
+  public:
+    DirIndex();
+    ~DirIndex();
+
+  public:
+    // "index.html,index.htm", an empty list serves no index file
+    bool set_names(const char *names);
+
+    const std::vector<std::string> &names() const { return m_names; }
+
+    void enable_listings() { m_listings = true; }
+
+    bool listings() const { return m_listings; }
+
+    // the inotify descriptor, -1 without listings or without inotify
+    bool open();
+
+    int watch_fd() const { return m_watch_fd; }
+
+    // on the reactor, drops the listings of directories that changed
+    void on_watch();
+
+    // dir_fd is the open directory at path, the caller unrefs the result
+    Listing *listing(int dir_fd, const struct stat &st, const char *path, bool json);
+
+    void report();
+
+  private:
+    Listing *render(int dir_fd, const struct stat &st, const char *path, bool json);
+
+    void drop(size_t i);
+
+  private:
+    std::vector<std::string> m_names;
+    bool m_listings;
+
+    int m_watch_fd;
+    std::vector<Listing *> m_cache;
+    uint64_t m_clock;
+    long m_hits;
+    long m_renders;
+    Mutex m_lock;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef _HANDLER_H_
+#define _HANDLER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define ROUTE_MAX_PARAMS 8
+#define REQUEST_MAX_HEADERS 32
+#define RESPONSE_HEAD_SIZE (1 << 10)
+#define RESPONSE_BODY_SIZE (16 << 10)
+
+// "ffffffff\r\n" in front of a chunk, "\r\n" behind it
+#define CHUNK_HEAD_LEN 10
+#define CHUNK_TAIL_LEN 2
+
+// HTTP Methods
+enum METHOD {
+    GET,
+    POST,
+    HEAD,
+    PUT,
+    DELETE,
+    TRACE,
+    OPTIONS,
+    CONNECT,
+    PATCH
+};
+
+#define METHOD_BIT(method) (1 << (method))
+#define ANY_METHOD 0
+
+// METHOD of a request line token, -1 if unknown
+int method_of(const char *name, int len);
+// the request line token of a METHOD
+const char *method_name(int method);
+
+// not NUL terminated, points into the connection buffers
+struct Slice {
+    const char *data;
+    int len;
+
+    bool equals(const char *s) const;
+};
+
+// valid until the handler returns, params are the ":name" segments then "*"
+struct RequestView {
+    METHOD method;
+    Slice path;
+    Slice query;
+    Slice body;
+
+    Slice header_names[REQUEST_MAX_HEADERS];
+    Slice header_values[REQUEST_MAX_HEADERS];
+    int header_count;
+
+    Slice params[ROUTE_MAX_PARAMS];
+    int param_count;
+
+    // case-insensitive, an empty slice when missing
+    Slice header(const char *name) const;
+
+    void add_header(const char *name, int name_len, const char *value, int value_len);
+};
+
+// fills buf with the next piece of a streamed body and returns its length,
+// 0 ends the body; a NULL buf means the client went away. The producer frees
+// its state when it returns 0 or less or is called with a NULL buf.
+typedef int (*BodyProducer)(char *buf, int size, void *state);
+
+class Response {
+  public:
+    void reset();
+
+    bool status(int code, const char *reason);
+
+    bool header(const char *name, const char *format, ...);
+
+    // buffered body, sent with a Content-Length
+    bool write(const char *data, int len);
+
+    bool print(const char *format, ...);
+
+    // the body is pulled from producer as the socket drains, chunked on HTTP/1.1
+    void stream(BodyProducer producer, void *state);
+
+    // tells a producer that never ran to let go of its state
+    void cancel();
+
+  public:
+    int m_status;
+    const char *m_reason;
+    char m_head[RESPONSE_HEAD_SIZE];
+    int m_head_len;
+    bool m_has_type;
+
+    char m_body[RESPONSE_BODY_SIZE];
+    int m_body_len;
+
+    BodyProducer m_producer;
+    void *m_state;
+    bool m_failed;
+};
+
+typedef void (*Handler)(const RequestView &request, Response &response, void *arg);
+
+// where a handler may run: INLINE ones must not block the reactor
+enum HANDLER_MODE {
+    HANDLER_INLINE,
+    HANDLER_POOL
+};
+
+struct Route {
+    int methods;
+    Handler handler;
+    void *arg;
+    HANDLER_MODE mode;
+
+    // the next route on the same pattern, -1 at the end
+    int next;
+};
+
+/*
+    Patterns are static text with ":name" segments matching one segment and
+    a trailing "*" matching the rest. They are inserted into a radix trie
+    and compile() flattens it breadth first, so the children of a node are
+    one contiguous run of nodes and the labels one string. Static edges win
+    over a parameter, a parameter over "*".
+*/
+class Router {
+  public:
+    Router();
+    ~Router();
+
+  public:
+    bool add(int methods, const char *pattern, Handler handler, void *arg, HANDLER_MODE mode);
+
+    bool compile();
+
+    bool enabled() const { return !m_nodes.empty(); }
+
+    // NULL when nothing matches, *allowed says if the path matched another method
+    const Route *match(METHOD method, const char *path, int len, RequestView *request, bool *allowed) const;
+
+    // peeks the request line of a buffered request
+    bool runs_inline(const char *line, int len) const;
+
+  private:
+    struct Node {
+        uint32_t label;
+        uint16_t label_len;
+        uint16_t child_count;
+        int32_t first_child;
+        int32_t param;
+        int32_t wild;
+        int32_t route;
+    };
+
+    int find(int index, const char *path, int len, int pos, Slice *params, int *count) const;
+
+  private:
+    std::vector<Route> m_routes;
+    std::vector<std::string> m_patterns;
+
+    std::vector<Node> m_nodes;
+    std::string m_labels;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_ENTRIES 61
+
+typedef std::pair<std::string, std::string> HeaderField;
+
+class HPackTable {
+  public:
+    HPackTable();
+    ~HPackTable();
+
+  public:
+    const HeaderField *get(unsigned int index) const;
+
+    int find(const char *name, const char *value, bool &exact) const;
+
+    void add(const std::string &name, const std::string &value);
+
+    void resize(int max_size);
+
+    int max_size() const { return m_max_size; }
+
+  private:
+    void evict(int room);
+
+  private:
+    std::deque<HeaderField> m_entries;
+    int m_size;
+    int m_max_size;
+};
+
+class HPackDecoder {
+  public:
+    HPackDecoder();
+    ~HPackDecoder();
+
+  public:
+    bool decode(const unsigned char *data, int len, std::vector<HeaderField> &headers);
+
+  private:
+    HPackTable m_table;
+};
+
+class HPackEncoder {
+  public:
+    HPackEncoder();
+    ~HPackEncoder();
+
+  public:
+    void resize(int max_size);
+
+    void encode(const char *name, const char *value, bool index, std::string &block);
+
+  private:
+    HPackTable m_table;
+    int m_pending_size;
+};
+
+#endif
@@ -3,8 +3,11 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <atomic>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/openat2.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
@@ -12,45 +15,68 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "bundle.h"
+#include "dirindex.h"
+#include "handler.h"
+#include "listener.h"
+#include "mime.h"
 #include "mutex.h"
+#include "proxy.h"
+#include "readahead.h"
+#include "scheduler.h"
+#include "tls.h"
+#include "trace.h"
+#include "vhost.h"
+#include "warm.h"
 
 #define OK_200_TITLE "OK"
+#define MOVED_301_TITLE "Moved Permanently"
+#define NOT_MODIFIED_304_TITLE "Not Modified"
 #define ERROR_400_TITLE "Bad Request"
 #define ERROR_400_form "Your request has bad syntax or is inherently impossible to satisfy.\n"
 #define ERROR_403_TITLE "Forbidden"
 #define ERROR_403_form "You do not have permission to get file from this server.\n"
 #define ERROR_404_TITLE "Not Found"
 #define ERROR_404_form "The requested file was not found on this server.\n"
+#define ERROR_405_TITLE "Method Not Allowed"
+#define ERROR_405_form "The requested method is not allowed for this resource.\n"
+#define ERROR_413_TITLE "Payload Too Large"
+#define ERROR_413_form "The request body does not fit in the request buffer.\n"
 #define ERROR_500_TITLE "Internal Error"
 #define ERROR_500_form "There was an unusual problem serving the requested file.\n"
+#define ERROR_502_TITLE "Bad Gateway"
+#define ERROR_502_form "The upstream server did not answer the request.\n"
 
 #define MAX_FD (1 << 16)
 #define MAX_EVENT_NUMBER (8 << 10)
 
+// epoll data of a descriptor, generation 0 for listeners and upstreams
+#define EVENT_TOKEN(fd, gen) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+#define EVENT_FD(token) ((int)(uint32_t)(token))
+#define EVENT_GEN(token) ((uint32_t)((token) >> 32))
+
+// seconds in flight responses get after SIGTERM or a handover
+#define DRAIN_TIMEOUT 30
+
+// the socket to the old process during a binary upgrade
+#define UPGRADE_FD 3
+#define UPGRADE_ENV "XHTTPD_UPGRADE_FD"
+
 #define BUFFER_SIZE (2 << 10)
 #define FILENAME_LEN 0xFF
 
-// HTTP Methods
-enum METHOD {
-    GET,
-    POST,
-    HEAD,
-    PUT,
-    DELETE,
-    TRACE,
-    OPTIONS,
-    CONNECT,
-    PATCH
-};
-
 // HTTP State
 enum CHECK_STATE {
     CHECK_STATE_REQUESTLINE,
@@ -67,7 +93,22 @@ enum HTTP_CODE {
     FORBIDDEN_REQUEST,
     FILE_REQUEST,
     INTERNAL_ERROR,
-    CLOSED_CONNECTION
+    CLOSED_CONNECTION,
+    PROXY_REQUEST,
+    BAD_GATEWAY,
+    NOT_MODIFIED,
+    HANDLER_REQUEST,
+    METHOD_NOT_ALLOWED,
+    MOVED_PERMANENTLY,
+    PAYLOAD_TOO_LARGE
+};
+
+// who may touch a connection, handed over with release/acquire
+enum CONN_OWNER {
+    OWNER_NONE,
+    OWNER_EPOLL,
+    OWNER_REACTOR,
+    OWNER_WORKER
 };
 
 // LINE Status
@@ -77,32 +118,155 @@ enum LINE_STATUS {
     LINE_OPEN
 };
 
+int set_nonblocking(int fd);
+
+void add_fd(int epoll_fd, int fd, bool one_shot, uint32_t gen = 0);
+
+void remove_fd(int epoll_fd, int fd);
+
+void mod_fd(int epoll_fd, int fd, int ev, uint32_t gen = 0);
+
+bool normalize_url(const char *url, char *path, int size);
+
+// the normalized path encoded again with a leading slash, the directory slash and the query kept
+bool canonical_url(const char *url, char *out, int size);
+
+int open_beneath(int root_fd, const char *path);
+
+// a directory gets its index file or, with listings on, a Listing in place of the mapping,
+// a large file also starts readahead
+HTTP_CODE map_file(int root_fd, const char *url, DirIndex *dirs, bool json, struct stat *st, char **address,
+                   const char **type, Listing **listing, ReadAhead *readahead);
+
+HTTP_CODE map_bundle(BundleStore *bundles, const DirIndex *dirs, const char *url, int accept, const char *if_none_match,
+                     BundleFile *file);
+
+class HTTP2Session;
+
 class HTTPServer {
   public:
-    HTTPServer(const char *, int, const char *);
+    HTTPServer(const char *);
     ~HTTPServer();
 
   public:
+    bool add_listener(const char *spec);
+
+    // dynamic endpoints, registered before serve_forever()
+    bool route(int methods, const char *pattern, Handler handler, void *arg, HANDLER_MODE mode = HANDLER_POOL);
+
+    bool add_proxy(const char *spec);
+
+    // a name-based site, requests for other names get doc_root
+    bool add_vhost(const char *spec);
+
+    bool enable_tls(const char *cert, const char *key);
+
+    bool load_bundle(const char *path);
+
+    // index files tried for a directory, comma separated
+    bool set_index(const char *names);
+
+    // directories without an index file are listed as HTML, or JSON on request
+    void enable_listings();
+
+    // files from threshold bytes up are streamed with page cache hints
+    void configure_large_files(off_t threshold, int keep_hits);
+
+    bool load_warm_manifest(const char *path, double fraction);
+
+    // quantum per write turn, rates in bytes per second, 0 for no cap
+    void configure_writes(long quantum, long conn_rate, long global_rate);
+
+    WriteScheduler *write_scheduler() { return &scheduler; }
+
+    void record_access(const char *path);
+
+    // every rate-th request is timed stage by stage, SIGHUP dumps them to path
+    void enable_trace(const char *path, int rate);
+
+    // SIGUSR2 re-executes argv, the new process gets the listening sockets
+    void enable_upgrade(char **argv);
+
+    void set_drain_timeout(int seconds);
+
+    void set_threads(int threads);
+
+    // returns after a graceful shutdown or a handover
     int serve_forever();
 
+  public:
+    // set from the SIGHUP handler, the reactor swaps the bundle
+    static volatile sig_atomic_t reload_pending;
+
+    // SIGTERM and SIGINT
+    static volatile sig_atomic_t shutdown_pending;
+
+    // SIGUSR2
+    static volatile sig_atomic_t upgrade_pending;
+
   private:
     void show_error(int, const char *);
 
+    Listener *listener_of(int fd);
+
+    void accept_all(Listener *listener, HTTPConn *conns);
+
+    bool start_upgrade();
+
+    void finish_upgrade(HTTPConn *conns);
+
+    void take_over();
+
+    void drain(HTTPConn *conns, bool handed_over);
+
+    // the connection an event is for, NULL when it outlived it
+    HTTPConn *claim(HTTPConn *conns, uint64_t token);
+
   private:
     int epoll_fd;
-    int listen_fd;
+    std::vector<Listener *> listeners;
 
     char doc_root[FILENAME_LEN];
-    struct sockaddr_in address;
+    int root_fd;
+
+    Proxy proxy;
+    Router router;
+    WriteScheduler scheduler;
+    TLSContext tls;
+    BundleStore bundles;
+    VirtualHosts vhosts;
+    DirIndex dirs;
+    LargeFiles large_files;
+
+    Warmer warmer;
+    double warm_fraction;
+    AccessRecorder recorder;
+    Timeline timeline;
+
+    int threads;
+    long stale_events;
+
+    char **upgrade_argv;
+    int upgrade_fd;
+    pid_t upgrade_pid;
+
+    bool draining;
+    int drain_timeout;
+    time_t drain_deadline;
 };
 
 class HTTPConn {
+    friend class Proxy;
+    friend class HTTP2Session;
+
   public:
-    HTTPConn() {}
+    HTTPConn()
+        : m_sock_fd(-1), m_generation(0), m_owner(OWNER_NONE), m_listing(NULL), m_idle(false), m_span(NULL),
+          m_traced(false) {}
     ~HTTPConn() {}
 
   public:
-    void init(int sock_fd, const sockaddr_in &addr);
+    void init(int sock_fd, const sockaddr_storage &addr);
 
     void close_conn(bool real_close = true);
 
@@ -112,9 +276,70 @@ class HTTPConn {
 
     bool write();
 
+    bool is_http2() const { return m_h2 != NULL; }
+
+    bool flush();
+
+    // from_reactor marks an HTTP/2 connection with nothing in flight idle
+    void rearm(bool from_reactor = false);
+
+    // a parked connection has tokens again
+    void resume();
+
+    // hands the connection back to epoll, the next event goes to the reactor
+    void arm(int ev);
+
+    // reactor only, an armed connection becomes the reactor's
+    bool claim() {
+        int owner = OWNER_EPOLL;
+        return m_owner.compare_exchange_strong(owner, OWNER_REACTOR, std::memory_order_acquire);
+    }
+
+    // right before the pool gets it, the reactor must not touch it after
+    void to_worker();
+
+    uint32_t generation() const { return m_generation; }
+
+    bool handshaking() const { return m_handshaking; }
+
+    bool tls_pending() const { return m_ssl && SSL_pending(m_ssl) > 0; }
+
+    // plain socket writes still reach the peer encrypted (no TLS, or kTLS)
+    bool raw_send() const { return !m_ssl || m_ktls_send; }
+
+    ssize_t recv_some(char *buf, size_t len);
+
+    ssize_t send_iov(const struct iovec *iov, int count);
+
+    // a TLS record OpenSSL waits on goes again whole, whatever the turn grants
+    long send_budget(long budget) const { return (m_tls_retry > budget) ? m_tls_retry : budget; }
+
+    void record_hit(const char *url, HTTP_CODE ret, const Site *site);
+
+    // the buffered request goes to an INLINE handler, no worker needed
+    bool runs_inline() const;
+
+    // a POOL handler has to produce the next chunk on a worker
+    bool stream_pending() const { return m_stream_pending; }
+
+    // waiting for a request and owned by the reactor, read on the reactor only
+    bool idle() const { return m_idle && m_sock_fd != -1; }
+
+    // closes HTTP/1, sends GOAWAY on HTTP/2
+    void close_idle();
+
+    // stamps a stage of a sampled request
+    void mark(TRACE_STAGE stage) {
+        if (m_traced) {
+            m_span->ts[stage] = Timeline::now_us();
+        }
+    }
+
   private:
     void init();
 
+    void upgrade(HTTP_CODE ret);
+
     void show_request(const char *);
 
     bool process_write(HTTP_CODE ret);
@@ -141,45 +366,128 @@ class HTTPConn {
 
     bool add_status_line(int status, const char *title);
 
-    bool add_headers(int content_length);
+    bool add_headers(int content_length, const char *type);
 
     bool add_content_length(int content_length);
 
+    bool add_content_type(const char *type);
+
+    bool add_bundle_headers();
+
+    bool add_site_headers();
+
+    bool add_listing_headers();
+
     bool add_linger();
 
     bool add_blank_line();
 
+    void add_proxy_request();
+
+    HTTP_CODE run_handler();
+
+    bool add_handler_response();
+
+    bool next_chunk();
+
+    void begin_span();
+
+    void end_span();
+
   public:
     static int m_epoll_fd;
-    static int m_conn_count;
 
-    const char *doc_root;
+    // accepted on the reactor, closed on either side
+    static std::atomic<int> m_conn_count;
+
+    // responses say "Connection: close" and HTTP/2 sends GOAWAY
+    static std::atomic<bool> m_draining;
+
+    int root_fd;
+    Proxy *proxy;
+    Router *router;
+    WriteScheduler *scheduler;
+    TLSContext *tls;
+    BundleStore *bundles;
+    VirtualHosts *vhosts;
+    DirIndex *dirs;
+    LargeFiles *large_files;
+    AccessRecorder *recorder;
+    Timeline *timeline;
 
   private:
     int m_sock_fd;
-    sockaddr_in m_address;
+    // bumped on every accept, events carry it to tell a reused fd apart
+    uint32_t m_generation;
+    std::atomic<int> m_owner;
+    sockaddr_storage m_address;
+    char m_peer[INET6_ADDRSTRLEN + 8];
 
     char m_read_buf[BUFFER_SIZE];
     int m_read_idx;
     int m_checked_idx;
     int m_start_line;
+    int m_header_start;
+    int m_header_end;
     char m_write_buf[BUFFER_SIZE];
     int m_write_idx;
 
     CHECK_STATE m_check_state;
     METHOD m_method;
 
-    char m_real_file[FILENAME_LEN];
+    // m_url points here, unless only a proxy route takes the raw target
+    char m_canonical[BUFFER_SIZE];
     char *m_url;
+    // the request-target as the client sent it, what the proxy forwards
+    char *m_target;
     char *m_version;
     char *m_host;
     int m_content_length;
     bool m_linger;
+    bool m_upgrade_h2c;
+    char *m_h2_settings;
+    int m_accept;
+    char *m_if_none_match;
+    bool m_accept_json;
+    Site *m_site;
 
     char *m_file_address;
     struct stat m_file_stat;
+    const char *m_content_type;
+    BundleFile m_bundle_file;
+    // a rendered directory, m_file_address points into it
+    Listing *m_listing;
+    ReadAhead m_readahead;
+    bool m_sendfile;
     struct iovec m_iv[2];
     int m_iv_count;
+    WriteState m_write_state;
+    bool m_idle;
+
+    // kept across requests once the connection was sampled
+    TraceSpan *m_span;
+    bool m_traced;
+
+    // allocated on the first dynamic request of the connection
+    const Route *m_route;
+    bool m_route_denied;
+    RequestView *m_request;
+    Response *m_response;
+    bool m_stream_pending;
+
+    ProxyRoute *m_proxy_route;
+    // the request head and body sent upstream, kept for a retry
+    std::string m_proxy_req;
+    UpstreamConn *m_upstream;
+    int m_proxy_tries;
+
+    HTTP2Session *m_h2;
+
+    SSL *m_ssl;
+    bool m_handshaking;
+    bool m_ktls_send;
+    // length of the TLS record to retry, see tls_writev()
+    int m_tls_retry;
 };
 
 #endif
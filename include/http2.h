@@ -0,0 +1,210 @@
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "hpack.h"
+#include "http.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME_SIZE (16 << 10)
+#define H2_MAX_FRAME_LIMIT ((1 << 24) - 1)
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_STREAMS 100
+
+#define H2_INPUT_SIZE ((H2_MAX_FRAME_SIZE + H2_FRAME_HEADER_LEN) * 4)
+#define H2_OUTPUT_SIZE (64 << 10)
+#define H2_BATCH_FRAMES 32
+
+// HTTP/2 Frame Types
+enum H2_FRAME {
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+// HTTP/2 Frame Flags
+#define H2_FLAG_END_STREAM 0x01
+#define H2_FLAG_ACK 0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED 0x08
+#define H2_FLAG_PRIORITY 0x20
+
+// HTTP/2 Settings
+enum H2_SETTING {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+// HTTP/2 Error Codes
+enum H2_ERROR {
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR
+};
+
+class H2Stream {
+  public:
+    H2Stream();
+    ~H2Stream();
+
+  public:
+    void release();
+
+  public:
+    int m_id;
+    long m_window;
+    bool m_done;
+    bool m_cancelled;
+
+    const char *m_body;
+    long m_body_len;
+    long m_body_sent;
+
+    char *m_file_address;
+    off_t m_file_size;
+    Bundle *m_bundle;
+    Listing *m_listing;
+    ReadAhead m_readahead;
+
+    // the target of a 301 to the directory with its slash
+    std::string m_location;
+
+    // a handler body, copied out of the session Response
+    std::string m_owned;
+
+    // picked by :authority, NULL for the default site
+    Site *m_site;
+};
+
+class HTTP2Session {
+  public:
+    HTTP2Session(HTTPConn *conn);
+    ~HTTP2Session();
+
+  public:
+    void start();
+
+    bool feed(const char *data, int len);
+
+    bool read();
+
+    bool upgrade(const char *settings, HTTP_CODE ret, char *address, off_t size, const char *type, const BundleFile *file);
+
+    bool process();
+
+    bool flush();
+
+    bool wants_write() const;
+
+    // no streams open and nothing to send
+    bool idle() const;
+
+    // GOAWAY without an error, the open streams still finish
+    void shutdown();
+
+  private:
+    bool finished() const;
+
+    bool sendable() const;
+
+    bool on_frame(int type, int flags, int stream_id, const unsigned char *payload, int len);
+
+    bool on_headers(int stream_id);
+
+    bool apply_settings(const unsigned char *payload, int len);
+
+    void on_request(H2Stream *stream, const std::vector<HeaderField> &headers);
+
+    void respond(H2Stream *stream, HTTP_CODE ret, char *address, off_t size, const char *type, const BundleFile *file);
+
+    void run_handler(H2Stream *stream, const Route *route, RequestView &request, const std::vector<HeaderField> &headers);
+
+    void queue_headers(H2Stream *stream, const std::string &block);
+
+    H2Stream *find(int stream_id);
+
+    H2Stream *open(int stream_id);
+
+    bool queue(int type, int flags, int stream_id, const void *payload, int len);
+
+    bool queue_raw(const char *data, int len);
+
+    void reset_stream(int stream_id, H2_ERROR error);
+
+    bool goaway(H2_ERROR error);
+
+    void build_batch();
+
+    void finish_batch();
+
+    void sweep();
+
+  private:
+    HTTPConn *m_conn;
+
+    char m_in[H2_INPUT_SIZE];
+    int m_in_len;
+    bool m_preface;
+
+    char m_out[H2_OUTPUT_SIZE];
+    int m_out_len;
+    int m_out_batched;
+
+    // frames being written, control output first then round-robin DATA
+    struct iovec m_iov[1 + H2_BATCH_FRAMES * 2];
+    unsigned char m_frame_heads[H2_BATCH_FRAMES][H2_FRAME_HEADER_LEN];
+    int m_iov_count;
+    int m_iov_idx;
+    int m_rr;
+
+    H2Stream m_streams[H2_MAX_STREAMS];
+    int m_stream_count;
+    int m_last_stream_id;
+
+    // header block spread over CONTINUATION frames
+    std::string m_header_block;
+    int m_continuation_id;
+    int m_continuation_flags;
+
+    long m_send_window;
+    long m_peer_window;
+    int m_peer_max_frame;
+
+    HPackDecoder m_decoder;
+    HPackEncoder m_encoder;
+
+    // reused by the handlers of this connection, one request at a time
+    Response *m_response;
+
+    // we sent GOAWAY, or the peer did and no new streams are taken
+    bool m_closing;
+    bool m_draining;
+    bool m_failed;
+};
+
+#endif
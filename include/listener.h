@@ -0,0 +1,63 @@
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <vector>
+
+#define MAX_LISTENERS 16
+#define LISTENER_NAME_LEN 0x80
+#define LISTEN_BACKLOG 511
+
+// spec is "host:port", "[v6]:port", "unix:/path" or "unix:@abstract",
+// passive takes "*:port" or ":port" as any address
+bool parse_address(const char *spec, struct sockaddr_storage *addr, socklen_t *len, bool passive);
+
+// "1.2.3.4", "::1" or "unix", mapped IPv4 is shown as IPv4
+void format_address(const struct sockaddr_storage *addr, char *buf, int size, bool port);
+
+class Listener {
+  public:
+    Listener();
+    ~Listener();
+
+  public:
+    // address then ",option" or ",option=value" items
+    bool parse(const char *spec);
+
+    bool open();
+
+    // a socket handed over by the process we replace
+    void adopt(int fd);
+
+    // also unlinks a unix socket file
+    void close();
+
+    // the socket went to another process, its file stays
+    void release();
+
+  public:
+    char m_name[LISTENER_NAME_LEN];
+    struct sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+    int m_fd;
+
+    // per listener socket options, -1 keeps the kernel default
+    int m_backlog;
+    int m_v6only;
+    int m_reuseport;
+    int m_nodelay;
+    int m_defer_accept;
+    int m_fastopen;
+    int m_rcvbuf;
+    int m_sndbuf;
+    int m_mode;
+};
+
+// the listening sockets and their names in one SCM_RIGHTS message
+bool send_listeners(int sock, const std::vector<Listener *> &listeners);
+
+// adopts the sockets whose names match, returns how many
+int receive_listeners(int sock, const std::vector<Listener *> &listeners);
+
+#endif
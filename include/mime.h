@@ -0,0 +1,30 @@
+#ifndef _MIME_H_
+#define _MIME_H_
+
+#include <stdint.h>
+
+#define MIME_DEFAULT "application/octet-stream"
+#define MIME_EXT_LEN 16
+#define MIME_MAX_TYPES 2048
+#define MIME_SLOTS 4096
+#define MIME_BUCKETS 1024
+
+struct MimeType {
+    const char *ext;
+    const char *type;
+};
+
+// hash and displace: every bucket has the displacement that moved all of
+// its extensions to free slots, a lookup is one hash and one probe
+struct MimeTable {
+    uint16_t disp[MIME_BUCKETS];
+    MimeType slots[MIME_SLOTS];
+    bool ok;
+};
+
+// mime.types format, a type followed by its extensions
+bool mime_load(const char *path);
+
+const char *mime_type(const char *path);
+
+#endif
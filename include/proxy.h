@@ -0,0 +1,201 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+#define MAX_UPSTREAMS 16
+#define MAX_PROXY_ROUTES 16
+#define PROXY_PREFIX_LEN 0x80
+
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_FAIL_TIMEOUT 10
+#define UPSTREAM_IDLE_CONNS 32
+
+#define UPSTREAM_HEAD_SIZE (8 << 10)
+#define RELAY_BUFFER_SIZE (16 << 10)
+#define SPLICE_CHUNK (64 << 10)
+
+class HTTPConn;
+
+// Upstream Connection State
+enum UPSTREAM_STATE {
+    UPSTREAM_IDLE,
+    UPSTREAM_CONNECTING,
+    UPSTREAM_SENDING,
+    UPSTREAM_HEADERS,
+    UPSTREAM_BODY
+};
+
+// Response Body Framing
+enum BODY_MODE {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_EOF
+};
+
+// Chunked Decoder State
+enum CHUNK_STATE {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_DONE
+};
+
+class Upstream {
+  public:
+    Upstream();
+    ~Upstream();
+
+  public:
+    bool parse(const char *spec);
+
+    bool available(time_t now) const;
+
+    void mark_ok();
+
+    void mark_failed(time_t now);
+
+    int take_idle();
+
+    bool put_idle(int fd);
+
+    void drop_idle(int fd);
+
+  public:
+    char m_name[PROXY_PREFIX_LEN];
+    struct sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+
+    int m_outstanding;
+    int m_fails;
+    time_t m_down_until;
+
+    std::vector<int> m_idle;
+};
+
+class ProxyRoute {
+  public:
+    ProxyRoute();
+    ~ProxyRoute();
+
+  public:
+    Upstream *pick(time_t now);
+
+  public:
+    char m_prefix[PROXY_PREFIX_LEN];
+    int m_prefix_len;
+
+    int m_next;
+    std::vector<Upstream *> m_upstreams;
+};
+
+class UpstreamConn {
+  public:
+    UpstreamConn(int fd, Upstream *upstream);
+    ~UpstreamConn();
+
+  public:
+    void reset();
+
+    bool open_pipe();
+
+    int consume(const char *data, int len);
+
+    int feed_chunked(const char *data, int len);
+
+  public:
+    int m_fd;
+    Upstream *m_upstream;
+    HTTPConn *m_client;
+    UPSTREAM_STATE m_state;
+    bool m_reused;
+    bool m_keep_alive;
+
+    // request, borrowed from the client write buffer
+    const char *m_req;
+    int m_req_len;
+    int m_req_sent;
+
+    // response header accumulation
+    char m_head[UPSTREAM_HEAD_SIZE];
+    int m_head_len;
+
+    // bytes pending towards the client
+    char m_buf[RELAY_BUFFER_SIZE];
+    int m_buf_len;
+    int m_buf_sent;
+
+    // zero-copy relay pipe
+    bool m_splice;
+    int m_pipe[2];
+    int m_pipe_len;
+
+    BODY_MODE m_body_mode;
+    long m_body_left;
+    bool m_body_done;
+
+    CHUNK_STATE m_chunk_state;
+    long m_chunk_left;
+};
+
+class Proxy {
+  public:
+    Proxy();
+    ~Proxy();
+
+  public:
+    bool add_route(const char *spec);
+
+    bool enabled() const { return m_route_count > 0; }
+
+    ProxyRoute *match(const char *url);
+
+    bool owns(int fd) const { return m_conns[fd] != NULL; }
+
+    bool relay(HTTPConn *conn);
+
+    void handle(int fd, unsigned int events);
+
+    void detach(HTTPConn *conn);
+
+  private:
+    bool start(HTTPConn *conn, bool fresh);
+
+    UpstreamConn *connect_upstream(Upstream *upstream, UPSTREAM_STATE &state);
+
+    bool pump(UpstreamConn *u);
+
+    bool on_writable(UpstreamConn *u);
+
+    bool on_headers(UpstreamConn *u);
+
+    bool parse_head(UpstreamConn *u, int head_end);
+
+    bool retry(UpstreamConn *u);
+
+    bool finish(UpstreamConn *u);
+
+    bool fail(UpstreamConn *u);
+
+    bool bad_gateway(HTTPConn *conn);
+
+    void release(UpstreamConn *u, bool reuse);
+
+  private:
+    int m_route_count;
+    ProxyRoute m_routes[MAX_PROXY_ROUTES];
+
+    UpstreamConn **m_conns;
+};
+
+#endif
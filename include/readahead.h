@@ -0,0 +1,125 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+#include "mutex.h"
+
+#define LARGE_FILE_SIZE (64 << 20)
+#define LARGE_FILE_TABLE 1024
+
+// requests within LARGE_FILE_DECAY seconds that keep a large file cached
+#define KEEP_CACHED_HITS 4
+#define LARGE_FILE_DECAY 60
+
+#define READAHEAD_MIN (256 << 10)
+#define READAHEAD_MAX (8 << 20)
+
+// sendfile pages stay referenced from the socket buffer until acked
+#define DROP_BEHIND_LAG (4 << 20)
+
+// DONTNEED skips a folio not wholly inside the range, folios reach 2m
+#define DROP_BEHIND_ALIGN (2 << 20)
+
+/*
+    Files of at least the threshold are streamed with page cache hints
+    instead of being left to the fault path. Requests are counted per
+    inode; the count halves every LARGE_FILE_DECAY seconds. A file asked
+    for KEEP_CACHED_HITS times in that time keeps its pages after they
+    are sent, the others give them back so they cannot push the small
+    hot files out. Pages are only given back while no other response
+    streams the same file. Shared by all workers.
+*/
+class LargeFiles {
+  public:
+    LargeFiles();
+
+  public:
+    // threshold 0 turns streaming off, keep_hits 0 never keeps a file cached
+    void configure(off_t threshold, int keep_hits);
+
+    bool streams(const struct stat &st) const { return m_threshold > 0 && st.st_size >= m_threshold; }
+
+    // counts a request and its reader, true when the file should stay cached
+    bool hit(const struct stat &st);
+
+    // another response streams the file too
+    bool shared(dev_t dev, ino_t ino);
+
+    // the reader is done, true while others still stream the file
+    bool leave(dev_t dev, ino_t ino);
+
+    void report();
+
+  private:
+    struct Entry {
+        dev_t dev;
+        ino_t ino;
+        int hits;
+        int readers;
+        time_t stamp;
+    };
+
+    static void decay(Entry *entry, time_t now);
+
+    Entry *find(dev_t dev, ino_t ino);
+
+  private:
+    off_t m_threshold;
+    int m_keep_hits;
+
+    std::vector<Entry> m_table;
+    long m_streamed;
+    long m_kept;
+    Mutex m_lock;
+};
+
+/*
+    The page cache window of one response. WILLNEED is issued a window
+    ahead of the send cursor. The window doubles while the client takes
+    one a second or faster, up to READAHEAD_MAX, and halves when it
+    lags, so pages are not fetched long before they are sent. Pages sent
+    DROP_BEHIND_LAG ago are dropped from the mapping and the page cache,
+    the rest of the window once the response ends, unless the file is
+    kept cached or another response streams it.
+*/
+class ReadAhead {
+  public:
+    ReadAhead();
+    ~ReadAhead();
+
+  public:
+    // keeps a descriptor of its own, the caller closes fd
+    void start(int fd, const struct stat &st);
+
+    bool active() const { return m_fd >= 0; }
+
+    int fd() const { return m_fd; }
+
+    // everything before pos was sent, mapping is the file mapping or NULL
+    void advance(off_t pos, char *mapping);
+
+    void stop();
+
+  public:
+    // set by the owner, the counts are shared
+    LargeFiles *files;
+    // set by the owner when the body goes out with sendfile from fd(), no mapping is made
+    bool sendfile;
+
+  private:
+    int m_fd;
+    dev_t m_dev;
+    ino_t m_ino;
+    off_t m_size;
+    off_t m_ahead;
+    off_t m_behind;
+    long m_window;
+    time_t m_issued;
+    bool m_keep;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <sys/uio.h>
+#include <vector>
+
+#include "mutex.h"
+
+#define WRITE_QUANTUM (256 << 10)
+#define WRITE_TICK_MS 10
+#define WRITE_BURST_MS 50
+
+class HTTPConn;
+
+// what the scheduler keeps per connection
+struct WriteState {
+    long deficit;
+    long tokens;
+    long refilled_ms;
+    bool parked;
+};
+
+/*
+    Deficit round-robin over the connections with output. Every write turn
+    adds a quantum to the deficit of the connection, the turn ends once it
+    is spent and the connection yields by re-arming EPOLLOUT, so the epoll
+    ready list carries it behind the others. With a rate set, per
+    connection or global token buckets bound the turn too; a connection
+    out of tokens is parked unarmed until the coarse tick refills them.
+    Turns, parking and the tick run on the reactor; a worker closing a
+    connection may forget it, so the parked list takes a lock.
+*/
+class WriteScheduler {
+  public:
+    WriteScheduler();
+    ~WriteScheduler();
+
+  public:
+    void configure(long quantum, long conn_rate, long global_rate);
+
+    void reset(WriteState *state);
+
+    // bytes this turn may send, 0 when the buckets are empty
+    long grant(WriteState *state);
+
+    void charge(WriteState *state, long bytes);
+
+    // all output went out, no credit is kept for the next response
+    void finish(WriteState *state);
+
+    void yield() { m_yields++; }
+
+    void park(HTTPConn *conn, WriteState *state);
+
+    void forget(HTTPConn *conn, WriteState *state);
+
+    // refills the buckets and re-arms parked connections, once per tick
+    void tick();
+
+    // epoll_wait timeout while connections are parked
+    int timeout() const;
+
+    void report() const;
+
+    unsigned long yields() const { return m_yields; }
+
+    unsigned long stalls() const { return m_stalls; }
+
+  private:
+    long now_ms() const;
+
+  private:
+    long m_quantum;
+    long m_conn_rate;
+    long m_global_rate;
+
+    long m_tokens;
+    long m_refilled_ms;
+    long m_ticked_ms;
+
+    std::vector<HTTPConn *> m_parked;
+    mutable Mutex m_lock;
+
+    unsigned long long m_bytes;
+    unsigned long m_yields;
+    unsigned long m_stalls;
+};
+
+// the leading iovecs of in holding at most budget bytes, the last one cut short
+int clamp_iov(const struct iovec *in, int count, long budget, struct iovec *out);
+
+#endif
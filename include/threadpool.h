@@ -7,6 +7,7 @@
 #include <pthread.h>
 
 #include "mutex.h"
+#include "trace.h"
 
 #define DEFAULT_THREAD_NUMBER 4
 #define MAX_REQUESTS_NUMBER 1000
@@ -81,6 +82,7 @@ bool threadpool<T>::append(T *request) {
         return false;
     }
     m_workqueue.push_back(request);
+    TRACE_PROBE(queue, request, m_workqueue.size());
     m_queue_mu.unlock();
     m_queue_flag.post();
     return true;
@@ -105,6 +107,7 @@ void threadpool<T>::run() {
 
         T *request = m_workqueue.front();
         m_workqueue.pop_front();
+        TRACE_PROBE(dequeue, request, m_workqueue.size());
         m_queue_mu.unlock();
         if (!request) {
             continue;
@@ -0,0 +1,47 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TLS_SESSION_CACHE_SIZE (20 << 10)
+#define TLS_SESSION_TIMEOUT 3600
+#define TLS_TICKETS 2
+#define TLS_RECORD_SIZE (16 << 10)
+
+class TLSContext {
+  public:
+    TLSContext();
+    ~TLSContext();
+
+  public:
+    bool load(const char *cert, const char *key);
+
+    bool enabled() const { return m_ctx != NULL; }
+
+    SSL *accept(int fd);
+
+    // ALPN offers http/1.1 only when off
+    void offer_h2(bool on) { m_h2 = on; }
+
+  private:
+    SSL_CTX *m_ctx;
+    bool m_h2;
+};
+
+// HTTPConn I/O over TLS, all non-blocking, EAGAIN when OpenSSL wants more
+int tls_handshake(SSL *ssl, bool &want_write);
+
+ssize_t tls_recv(SSL *ssl, char *buf, size_t len);
+
+// pending is the length of the record OpenSSL waits to complete, 0 for none,
+// the next call must offer at least that much from the same position
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int count, int *pending);
+
+bool tls_ktls_send(SSL *ssl);
+
+bool tls_ktls_recv(SSL *ssl);
+
+#endif
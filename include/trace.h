@@ -0,0 +1,90 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// systemtap-sdt-dev provides the header, without it the probes compile away
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT 1
+#endif
+#endif
+
+// USDT probe xhttpd:name, a single nop until bpftrace or perf attaches
+#ifdef TRACE_USDT
+#define TRACE_PROBE(name, a, b) DTRACE_PROBE2(xhttpd, name, a, b)
+#else
+#define TRACE_PROBE(name, a, b) ((void)0)
+#endif
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_URL_LEN 64
+#define TRACE_SAMPLE_RATE 100
+
+// stage boundaries of an HTTP/1.1 request, in order
+enum TRACE_STAGE {
+    STAGE_READ,
+    STAGE_QUEUED,
+    STAGE_PICKED,
+    STAGE_PARSED,
+    STAGE_RESOLVED,
+    STAGE_WRITING,
+    STAGE_DONE,
+    STAGE_COUNT
+};
+
+// one sampled request, 0 for the stages it skipped
+struct TraceSpan {
+    uint64_t id;
+    int fd;
+    int code;
+    long bytes;
+    int stalls;
+    char url[TRACE_URL_LEN];
+    uint64_t ts[STAGE_COUNT];
+};
+
+/*
+    Every rate-th request carries a TraceSpan and gets a timestamp at each
+    stage. Finished spans go into a ring of TRACE_RING_SIZE slots: a writer
+    claims one with fetch_add and guards it with a sequence number, odd
+    while it copies, so the dump skips a slot torn by a writer instead of
+    taking a lock on the write path. The oldest spans are overwritten.
+*/
+class Timeline {
+  public:
+    Timeline();
+    ~Timeline();
+
+  public:
+    void configure(const char *path, int rate);
+
+    bool enabled() const { return m_rate > 0; }
+
+    // true for every rate-th call, the id numbers the sampled requests
+    bool sample(uint64_t *id);
+
+    void commit(const TraceSpan &span);
+
+    // Chrome trace JSON, for chrome://tracing or ui.perfetto.dev
+    bool dump();
+
+    static uint64_t now_us();
+
+  private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        TraceSpan span;
+    };
+
+    char m_path[0x100];
+    int m_rate;
+
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_head;
+    Slot *m_slots;
+};
+
+#endif
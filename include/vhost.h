@@ -0,0 +1,73 @@
+#ifndef _VHOST_H_
+#define _VHOST_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bundle.h"
+
+#define HOST_NAME_LEN 0x100
+#define SITE_ROOT_LEN 0x100
+
+// one name-based virtual host, its files and headers are its own
+struct Site {
+    char name[HOST_NAME_LEN];
+    char doc_root[SITE_ROOT_LEN];
+    int root_fd;
+
+    // a bundle of its own, mapped and reloaded apart from the others
+    BundleStore bundles;
+
+    // "Name: value\r\n" lines for HTTP/1.1, lowercase pairs for HTTP/2
+    std::string head;
+    std::vector<std::pair<std::string, std::string> > headers;
+};
+
+/*
+    Host names, exact or "*.suffix", hash to their site in an open
+    addressing table built by open(). A wildcard is stored as ".suffix",
+    so find() probes the whole host and then each suffix starting at a
+    dot, longest first. The hash is taken over the lowercased Host value
+    in place, without the port and without copying it.
+*/
+class VirtualHosts {
+  public:
+    VirtualHosts();
+    ~VirtualHosts();
+
+  public:
+    // "name[,name...]=dir" or "=bundle:file", then ";Name: value" headers
+    bool add(const char *spec);
+
+    // opens the doc roots, maps the bundles and builds the table
+    bool open();
+
+    bool enabled() const { return !m_sites.empty(); }
+
+    // NULL for a missing or unknown Host, the default site answers then
+    Site *find(const char *host) const;
+
+    void reload();
+
+  private:
+    struct Slot {
+        uint64_t hash;
+        uint32_t name;
+        uint16_t len;
+        int16_t site;
+    };
+
+    Site *probe(const char *host, int len, uint64_t hash) const;
+
+  private:
+    std::vector<Site *> m_sites;
+    std::vector<std::pair<std::string, int> > m_names;
+
+    std::vector<Slot> m_table;
+    uint64_t m_mask;
+    std::string m_arena;
+};
+
+#endif
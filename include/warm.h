@@ -0,0 +1,79 @@
+#ifndef _WARM_H_
+#define _WARM_H_
+
+#include <map>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "bundle.h"
+#include "mutex.h"
+
+#define WARM_THREADS 8
+#define WARM_POLL_MS 5
+#define WARM_PROGRESS_MS 500
+#define WARM_RECORD_INTERVAL 60
+
+// pulls the files of a manifest into the page cache before accepting
+class Warmer {
+  public:
+    Warmer();
+    ~Warmer();
+
+  public:
+    bool load(const char *manifest);
+
+    bool enabled() const { return !m_paths.empty(); }
+
+    void start(int root_fd, BundleStore *bundles);
+
+    // blocks until the fraction is warm, the rest carries on behind
+    void wait(double fraction);
+
+  private:
+    static void *worker(void *arg);
+
+    void run();
+
+    void warm(const char *url);
+
+  private:
+    std::vector<std::string> m_paths;
+    int m_root_fd;
+    BundleStore *m_bundles;
+
+    size_t m_next;
+    size_t m_done;
+    long long m_bytes;
+    struct timespec m_started;
+    Mutex m_lock;
+};
+
+// counts file hits so the next start can warm the hottest paths first
+class AccessRecorder {
+  public:
+    AccessRecorder();
+    ~AccessRecorder();
+
+  public:
+    void open(const char *manifest);
+
+    bool enabled() const { return m_manifest[0] != 0; }
+
+    void hit(const char *url);
+
+    // rewrites the manifest, hottest first, when something changed
+    bool dump();
+
+    // from the reactor, dumps every WARM_RECORD_INTERVAL seconds
+    void tick();
+
+  private:
+    char m_manifest[0x100];
+    std::map<std::string, unsigned long> m_hits;
+    bool m_dirty;
+    time_t m_last_dump;
+    Mutex m_lock;
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+
+static const char *encoding_names[BUNDLE_ENCODINGS] = {NULL, "gzip", "br"};
+
+/*
+    class Bundle
+*/
+
+Bundle::Bundle() {
+    m_fd = -1;
+    m_base = NULL;
+    m_size = 0;
+    m_refs = 1;
+}
+
+Bundle::~Bundle() {
+    if (m_base) {
+        munmap(m_base, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+// mapped once, deploys rename a new file over the path instead of rewriting it
+Bundle *Bundle::open(const char *path) {
+    Bundle *bundle = new Bundle;
+    struct stat st;
+
+    bundle->m_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (bundle->m_fd < 0 || fstat(bundle->m_fd, &st) < 0 || st.st_size < (off_t)sizeof(BundleHeader)) {
+        delete bundle;
+        return NULL;
+    }
+
+    bundle->m_size = st.st_size;
+    bundle->m_base = (char *)mmap(0, bundle->m_size, PROT_READ, MAP_SHARED, bundle->m_fd, 0);
+    if (bundle->m_base == MAP_FAILED) {
+        bundle->m_base = NULL;
+        delete bundle;
+        return NULL;
+    }
+
+    const BundleHeader *h = (const BundleHeader *)bundle->m_base;
+    bundle->m_header = h;
+    bundle->m_disp = (const uint32_t *)(bundle->m_base + h->disp_offset);
+    bundle->m_slots = (const uint32_t *)(bundle->m_base + h->slot_offset);
+    bundle->m_entries = (const BundleEntry *)(bundle->m_base + h->entry_offset);
+    bundle->m_strings = bundle->m_base + h->string_offset;
+
+    if (!bundle->check()) {
+        delete bundle;
+        return NULL;
+    }
+    return bundle;
+}
+
+// every offset is validated here so requests can trust the file
+bool Bundle::check() const {
+    const BundleHeader *h = m_header;
+    if (memcmp(h->magic, BUNDLE_MAGIC, 8) != 0 || h->version != BUNDLE_VERSION || h->size != m_size) {
+        return false;
+    }
+    if (h->buckets == 0 || (h->buckets & (h->buckets - 1)) || h->slots == 0 || (h->slots & (h->slots - 1))) {
+        return false;
+    }
+
+    uint64_t size = m_size;
+    struct {
+        uint64_t offset;
+        uint64_t len;
+    } tables[] = {
+        {h->disp_offset, (uint64_t)h->buckets * sizeof(uint32_t)},
+        {h->slot_offset, (uint64_t)h->slots * sizeof(uint32_t)},
+        {h->entry_offset, (uint64_t)h->count * sizeof(BundleEntry)},
+        {h->string_offset, h->string_size},
+    };
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (tables[i].offset % 8 || tables[i].offset > size || tables[i].len > size - tables[i].offset) {
+            return false;
+        }
+    }
+    if (h->string_size == 0 || m_strings[h->string_size - 1] != 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h->slots; i++) {
+        if (m_slots[i] > h->count) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < h->count; i++) {
+        const BundleEntry *e = m_entries + i;
+        if (e->path >= h->string_size || e->type >= h->string_size || e->last_modified >= h->string_size) {
+            return false;
+        }
+        for (int j = 0; j < BUNDLE_ENCODINGS; j++) {
+            if (e->body[j].offset > size || e->body[j].size > size - e->body[j].offset ||
+                e->body[j].etag >= h->string_size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// one hash, one probe, one compare
+const BundleEntry *Bundle::find(const char *path) const {
+    int len = strlen(path);
+    uint64_t h = bundle_hash(path, len);
+    uint32_t disp = m_disp[h & (m_header->buckets - 1)];
+    uint32_t index = m_slots[bundle_slot(h, disp, m_header->slots)];
+    if (index == 0) {
+        return NULL;
+    }
+
+    const BundleEntry *entry = m_entries + index - 1;
+    if (strcmp(string(entry->path), path) != 0) {
+        return NULL;
+    }
+    return entry;
+}
+
+void Bundle::fill(const BundleEntry *entry, int accept, BundleFile *file) {
+    int encoding = BUNDLE_IDENTITY;
+    // the smallest variant the client takes, br before gzip
+    for (int i = BUNDLE_ENCODINGS - 1; i > BUNDLE_IDENTITY; i--) {
+        if ((accept & (1 << i)) && entry->body[i].size) {
+            encoding = i;
+            break;
+        }
+    }
+
+    const BundleBody *body = entry->body + encoding;
+    file->bundle = this;
+    file->address = m_base + body->offset;
+    file->offset = body->offset;
+    file->size = body->size;
+    file->mtime = entry->mtime;
+    file->type = string(entry->type);
+    file->etag = string(body->etag);
+    file->last_modified = string(entry->last_modified);
+    file->encoding = encoding_names[encoding];
+    file->vary = entry->body[BUNDLE_GZIP].size || entry->body[BUNDLE_BR].size;
+}
+
+void Bundle::ref() {
+    m_lock.lock();
+    m_refs++;
+    m_lock.unlock();
+}
+
+// the last response out of a replaced bundle unmaps it
+void Bundle::unref() {
+    m_lock.lock();
+    bool last = (--m_refs == 0);
+    m_lock.unlock();
+    if (last) {
+        delete this;
+    }
+}
+
+/*
+    class BundleStore
+*/
+
+BundleStore::BundleStore() {
+    m_path[0] = 0;
+    m_current = NULL;
+}
+
+BundleStore::~BundleStore() {
+    if (m_current) {
+        m_current->unref();
+    }
+}
+
+bool BundleStore::load(const char *path) {
+    strncpy(m_path, path, BUNDLE_PATH_LEN - 1);
+    m_path[BUNDLE_PATH_LEN - 1] = 0;
+    return reload();
+}
+
+// requests in flight keep the old bundle, new ones see the new one
+bool BundleStore::reload() {
+    Bundle *bundle = Bundle::open(m_path);
+    if (!bundle) {
+        printf("error: cannot load bundle %s\n", m_path);
+        return false;
+    }
+
+    m_lock.lock();
+    Bundle *old = m_current;
+    m_current = bundle;
+    m_lock.unlock();
+
+    if (old) {
+        old->unref();
+    }
+    printf("*) bundle %s with %u files\n", m_path, bundle->count());
+    return true;
+}
+
+bool BundleStore::lookup(const char *path, int accept, BundleFile *file) {
+    m_lock.lock();
+    Bundle *bundle = m_current;
+    bundle->ref();
+    m_lock.unlock();
+
+    const BundleEntry *entry = bundle->find(path);
+    if (!entry) {
+        bundle->unref();
+        return false;
+    }
+    bundle->fill(entry, accept, file);
+    return true;
+}
+
+int bundle_accept(const char *value) {
+    int mask = 0;
+    while (*value) {
+        value += strspn(value, " \t,");
+        int len = strcspn(value, " \t,;");
+        int params = strcspn(value + len, ",");
+
+        // "q=0" turns a coding off
+        const char *q = (const char *)memmem(value + len, params, "q=", 2);
+        bool refused = q && atof(q + 2) == 0;
+
+        if (!refused) {
+            for (int i = BUNDLE_IDENTITY + 1; i < BUNDLE_ENCODINGS; i++) {
+                if ((int)strlen(encoding_names[i]) == len && strncasecmp(value, encoding_names[i], len) == 0) {
+                    mask |= 1 << i;
+                }
+            }
+        }
+        value += len + params;
+    }
+    return mask;
+}
+
+bool bundle_etag_match(const char *value, const char *etag) {
+    return strcmp(value, "*") == 0 || strstr(value, etag) != NULL;
+}
@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "dirindex.h"
+
+// whatever adds, removes or rewrites an entry, or moves the directory away
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct DirEntry {
+    std::string name;
+    bool dir;
+    off_t size;
+    time_t mtime;
+};
+
+static bool entry_order(const DirEntry &a, const DirEntry &b) {
+    if (a.dir != b.dir) {
+        return a.dir;
+    }
+    return a.name < b.name;
+}
+
+static void put_html(std::string &out, const std::string &s) {
+    for (size_t i = 0; i < s.size(); i++) {
+        switch (s[i]) {
+        case '&':
+            out += "&amp;";
+            break;
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        case '"':
+            out += "&quot;";
+            break;
+        default:
+            out += s[i];
+        }
+    }
+}
+
+// the href of an entry, everything but unreserved characters percent-encoded
+static void put_url(std::string &out, const std::string &s) {
+    char hex[4];
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            out += c;
+        } else {
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            out += hex;
+        }
+    }
+}
+
+static void put_json(std::string &out, const std::string &s) {
+    char esc[8];
+    out += '"';
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/*
+    class Listing
+*/
+
+Listing::Listing() {
+    m_json = false;
+    m_etag[0] = 0;
+    m_wd = -1;
+    m_used = 0;
+    m_refs = 1;
+}
+
+void Listing::ref() {
+    m_lock.lock();
+    m_refs++;
+    m_lock.unlock();
+}
+
+// the cache and every response in flight hold one
+void Listing::unref() {
+    m_lock.lock();
+    bool last = (--m_refs == 0);
+    m_lock.unlock();
+    if (last) {
+        delete this;
+    }
+}
+
+/*
+    class DirIndex
+*/
+
+DirIndex::DirIndex() {
+    m_listings = false;
+    m_watch_fd = -1;
+    m_clock = 0;
+    m_hits = 0;
+    m_renders = 0;
+    set_names(DIRINDEX_NAMES);
+}
+
+DirIndex::~DirIndex() {
+    for (size_t i = 0; i < m_cache.size(); i++) {
+        m_cache[i]->unref();
+    }
+    if (m_watch_fd >= 0) {
+        close(m_watch_fd);
+    }
+}
+
+bool DirIndex::set_names(const char *names) {
+    std::vector<std::string> list;
+    const char *p = names;
+    while (*p) {
+        int len = strcspn(p, ",");
+        std::string name(p, len);
+        if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+            return false;
+        }
+        list.push_back(name);
+        p += len + (p[len] == ',');
+    }
+    m_names.swap(list);
+    return true;
+}
+
+bool DirIndex::open() {
+    if (!m_listings) {
+        return true;
+    }
+    m_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_watch_fd < 0) {
+        printf("*) no inotify, directory listings are checked by mtime only\n");
+        return true;
+    }
+    printf("*) directory listings on, up to %d cached\n", DIRINDEX_CACHE_SIZE);
+    return true;
+}
+
+void DirIndex::on_watch() {
+    // aligned for the struct, names of up to NAME_MAX follow each event
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t n = ::read(m_watch_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        m_lock.lock();
+        const struct inotify_event *event;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            // an overflowed queue lost some, nothing cached can be trusted
+            bool all = (event->mask & IN_Q_OVERFLOW) != 0;
+            for (size_t i = m_cache.size(); i-- > 0;) {
+                if (all || m_cache[i]->m_wd == event->wd) {
+                    drop(i);
+                }
+            }
+        }
+        m_lock.unlock();
+    }
+}
+
+Listing *DirIndex::listing(int dir_fd, const struct stat &st, const char *path, bool json) {
+    m_lock.lock();
+    for (size_t i = 0; i < m_cache.size(); i++) {
+        Listing *listing = m_cache[i];
+        if (listing->m_dev != st.st_dev || listing->m_ino != st.st_ino || listing->m_json != json) {
+            continue;
+        }
+        if (listing->m_mtime.tv_sec == st.st_mtim.tv_sec && listing->m_mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            listing->m_path == path) {
+            listing->m_used = ++m_clock;
+            listing->ref();
+            m_hits++;
+            m_lock.unlock();
+            return listing;
+        }
+        drop(i);
+        break;
+    }
+    m_lock.unlock();
+
+    // read without the lock, other directories keep being served meanwhile
+    Listing *listing = render(dir_fd, st, path, json);
+    if (!listing) {
+        return NULL;
+    }
+
+    m_lock.lock();
+    m_renders++;
+    if (st.st_mtime < time(NULL) - 1) {
+        for (size_t i = 0; i < m_cache.size(); i++) {
+            if (m_cache[i]->m_dev == st.st_dev && m_cache[i]->m_ino == st.st_ino && m_cache[i]->m_json == json) {
+                drop(i);
+                break;
+            }
+        }
+        if (m_cache.size() >= DIRINDEX_CACHE_SIZE) {
+            size_t oldest = 0;
+            for (size_t i = 1; i < m_cache.size(); i++) {
+                if (m_cache[i]->m_used < m_cache[oldest]->m_used) {
+                    oldest = i;
+                }
+            }
+            drop(oldest);
+        }
+
+        // the same inode gives the same watch, the lock keeps on_watch from removing it meanwhile
+        if (m_watch_fd >= 0) {
+            char proc[0x20];
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dir_fd);
+            listing->m_wd = inotify_add_watch(m_watch_fd, proc, WATCH_MASK);
+        }
+        listing->m_used = ++m_clock;
+        listing->ref();
+        m_cache.push_back(listing);
+    }
+    m_lock.unlock();
+    return listing;
+}
+
+void DirIndex::report() {
+    if (!m_listings) {
+        return;
+    }
+    m_lock.lock();
+    printf("*) listings: %zu cached, %ld hits, %ld renders\n", m_cache.size(), m_hits, m_renders);
+    m_lock.unlock();
+}
+
+Listing *DirIndex::render(int dir_fd, const struct stat &st, const char *path, bool json) {
+    // a descriptor of its own, closedir closes it and readdir moves its offset
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = (fd < 0) ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    // hidden entries and anything map_file would refuse stay out
+    std::vector<DirEntry> entries;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat est;
+        if (de->d_name[0] == '.' || fstatat(fd, de->d_name, &est, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (!(est.st_mode & S_IROTH) || !(S_ISREG(est.st_mode) || S_ISDIR(est.st_mode))) {
+            continue;
+        }
+        DirEntry entry = {de->d_name, S_ISDIR(est.st_mode), est.st_size, est.st_mtime};
+        entries.push_back(entry);
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), entry_order);
+
+    Listing *listing = new Listing;
+    listing->m_dev = st.st_dev;
+    listing->m_ino = st.st_ino;
+    listing->m_mtime = st.st_mtim;
+    listing->m_json = json;
+    listing->m_path = path;
+
+    std::string title = "/";
+    if (strcmp(path, ".") != 0) {
+        title += path;
+        title += "/";
+    }
+
+    std::string &out = listing->m_body;
+    char line[0x80];
+    char date[0x40];
+    struct tm tm;
+    if (json) {
+        out += "[";
+        for (size_t i = 0; i < entries.size(); i++) {
+            const DirEntry &entry = entries[i];
+            gmtime_r(&entry.mtime, &tm);
+            strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            out += (i == 0) ? "\n{\"name\":" : ",\n{\"name\":";
+            put_json(out, entry.name);
+            if (entry.dir) {
+                snprintf(line, sizeof(line), ",\"type\":\"directory\",\"mtime\":\"%s\"}", date);
+            } else {
+                snprintf(line, sizeof(line), ",\"type\":\"file\",\"mtime\":\"%s\",\"size\":%lld}", date,
+                         (long long)entry.size);
+            }
+            out += line;
+        }
+        out += "\n]\n";
+    } else {
+        out += "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ";
+        put_html(out, title);
+        out += "</title></head>\n<body>\n<h1>Index of ";
+        put_html(out, title);
+        out += "</h1>\n<table>\n<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n";
+        if (title != "/") {
+            out += "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n";
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            const DirEntry &entry = entries[i];
+            std::string name = entry.name + (entry.dir ? "/" : "");
+            out += "<tr><td><a href=\"";
+            put_url(out, entry.name);
+            out += entry.dir ? "/\">" : "\">";
+            put_html(out, name);
+            gmtime_r(&entry.mtime, &tm);
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+            if (entry.dir) {
+                snprintf(line, sizeof(line), "</a></td><td>%s</td><td>-</td></tr>\n", date);
+            } else {
+                snprintf(line, sizeof(line), "</a></td><td>%s</td><td>%lld</td></tr>\n", date, (long long)entry.size);
+            }
+            out += line;
+        }
+        out += "</table>\n</body>\n</html>\n";
+    }
+
+    snprintf(listing->m_etag, sizeof(listing->m_etag), "\"%016llx\"",
+             (unsigned long long)bundle_hash(out.data(), out.size()));
+    return listing;
+}
+
+// the cache lock is held, the watch goes with the last listing using it
+void DirIndex::drop(size_t i) {
+    Listing *listing = m_cache[i];
+    m_cache[i] = m_cache.back();
+    m_cache.pop_back();
+
+    bool shared = false;
+    for (size_t j = 0; j < m_cache.size(); j++) {
+        shared = shared || (m_cache[j]->m_wd == listing->m_wd);
+    }
+    if (listing->m_wd >= 0 && !shared) {
+        inotify_rm_watch(m_watch_fd, listing->m_wd);
+    }
+    listing->unref();
+}
@@ -0,0 +1,384 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "handler.h"
+
+static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+int method_of(const char *name, int len) {
+    for (int i = 0; i < (int)(sizeof(method_names) / sizeof(method_names[0])); i++) {
+        if ((int)strlen(method_names[i]) == len && strncasecmp(name, method_names[i], len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *method_name(int method) {
+    return method_names[method];
+}
+
+bool Slice::equals(const char *s) const {
+    return (int)strlen(s) == len && memcmp(data, s, len) == 0;
+}
+
+/*
+    struct RequestView
+*/
+
+Slice RequestView::header(const char *name) const {
+    int len = strlen(name);
+    for (int i = 0; i < header_count; i++) {
+        if (header_names[i].len == len && strncasecmp(header_names[i].data, name, len) == 0) {
+            return header_values[i];
+        }
+    }
+    Slice none = {"", 0};
+    return none;
+}
+
+// headers past REQUEST_MAX_HEADERS are not seen by handlers
+void RequestView::add_header(const char *name, int name_len, const char *value, int value_len) {
+    if (header_count >= REQUEST_MAX_HEADERS) {
+        return;
+    }
+    header_names[header_count].data = name;
+    header_names[header_count].len = name_len;
+    header_values[header_count].data = value;
+    header_values[header_count].len = value_len;
+    header_count++;
+}
+
+/*
+    class Response
+*/
+
+void Response::reset() {
+    m_status = 200;
+    m_reason = "OK";
+    m_head_len = 0;
+    m_has_type = false;
+    m_body_len = 0;
+    m_producer = NULL;
+    m_state = NULL;
+    m_failed = false;
+}
+
+bool Response::status(int code, const char *reason) {
+    m_status = code;
+    m_reason = reason;
+    return true;
+}
+
+bool Response::header(const char *name, const char *format, ...) {
+    int room = RESPONSE_HEAD_SIZE - m_head_len;
+    int len = snprintf(m_head + m_head_len, room, "%s: ", name);
+    if (len < room) {
+        va_list arg_list;
+        va_start(arg_list, format);
+        len += vsnprintf(m_head + m_head_len + len, room - len, format, arg_list);
+        va_end(arg_list);
+    }
+    if (len + 2 >= room) {
+        m_failed = true;
+        return false;
+    }
+    memcpy(m_head + m_head_len + len, "\r\n", 2);
+    m_head_len += len + 2;
+
+    if (strcasecmp(name, "Content-Type") == 0) {
+        m_has_type = true;
+    }
+    return true;
+}
+
+bool Response::write(const char *data, int len) {
+    if (len > RESPONSE_BODY_SIZE - m_body_len) {
+        m_failed = true;
+        return false;
+    }
+    memcpy(m_body + m_body_len, data, len);
+    m_body_len += len;
+    return true;
+}
+
+bool Response::print(const char *format, ...) {
+    int room = RESPONSE_BODY_SIZE - m_body_len;
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_body + m_body_len, room, format, arg_list);
+    va_end(arg_list);
+    if (len >= room) {
+        m_failed = true;
+        return false;
+    }
+    m_body_len += len;
+    return true;
+}
+
+void Response::stream(BodyProducer producer, void *state) {
+    m_producer = producer;
+    m_state = state;
+}
+
+void Response::cancel() {
+    if (m_producer) {
+        m_producer(NULL, 0, m_state);
+        m_producer = NULL;
+    }
+}
+
+/*
+    class Router
+*/
+
+// pointer trie used while building, compile() flattens it
+struct TrieNode {
+    std::string label;
+    std::vector<TrieNode *> children;
+    TrieNode *param;
+    TrieNode *wild;
+    int route;
+
+    TrieNode() : param(NULL), wild(NULL), route(-1) {}
+
+    ~TrieNode() {
+        for (size_t i = 0; i < children.size(); i++) {
+            delete children[i];
+        }
+        delete param;
+        delete wild;
+    }
+};
+
+static TrieNode *insert_static(TrieNode *node, const std::string &text) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        TrieNode *child = NULL;
+        for (size_t i = 0; i < node->children.size(); i++) {
+            if (node->children[i]->label[0] == text[pos]) {
+                child = node->children[i];
+                break;
+            }
+        }
+        if (!child) {
+            child = new TrieNode;
+            child->label = text.substr(pos);
+            node->children.push_back(child);
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->label.size() && pos + common < text.size() && child->label[common] == text[pos + common]) {
+            common++;
+        }
+
+        // the edge diverges inside its label, split it there
+        if (common < child->label.size()) {
+            TrieNode *tail = new TrieNode;
+            tail->label = child->label.substr(common);
+            tail->children.swap(child->children);
+            tail->param = child->param;
+            tail->wild = child->wild;
+            tail->route = child->route;
+
+            child->label.resize(common);
+            child->children.push_back(tail);
+            child->param = NULL;
+            child->wild = NULL;
+            child->route = -1;
+        }
+        node = child;
+        pos += common;
+    }
+    return node;
+}
+
+Router::Router() {}
+
+Router::~Router() {}
+
+bool Router::add(int methods, const char *pattern, Handler handler, void *arg, HANDLER_MODE mode) {
+    if (pattern[0] != '/' || !m_nodes.empty()) {
+        return false;
+    }
+    // "*" only as the last segment
+    const char *star = strchr(pattern, '*');
+    if (star && (star[-1] != '/' || star[1] != 0)) {
+        return false;
+    }
+
+    // a GET handler answers HEAD too
+    if (methods & METHOD_BIT(GET)) {
+        methods |= METHOD_BIT(HEAD);
+    }
+
+    Route route = {methods, handler, arg, mode, -1};
+    m_routes.push_back(route);
+    m_patterns.push_back(pattern);
+    return true;
+}
+
+bool Router::compile() {
+    if (m_routes.empty()) {
+        return true;
+    }
+
+    TrieNode root;
+    for (size_t i = 0; i < m_patterns.size(); i++) {
+        const std::string &pattern = m_patterns[i];
+        TrieNode *node = &root;
+        size_t pos = 0;
+        while (pos < pattern.size()) {
+            if (pattern[pos] == ':') {
+                if (!node->param) {
+                    node->param = new TrieNode;
+                }
+                node = node->param;
+                pos = pattern.find('/', pos);
+                pos = (pos == std::string::npos) ? pattern.size() : pos;
+            } else if (pattern[pos] == '*') {
+                if (!node->wild) {
+                    node->wild = new TrieNode;
+                }
+                node = node->wild;
+                pos++;
+            } else {
+                size_t end = pattern.find_first_of(":*", pos);
+                end = (end == std::string::npos) ? pattern.size() : end;
+                node = insert_static(node, pattern.substr(pos, end - pos));
+                pos = end;
+            }
+        }
+
+        // the same pattern for other methods chains behind the first
+        if (node->route < 0) {
+            node->route = i;
+        } else {
+            int last = node->route;
+            while (m_routes[last].next >= 0) {
+                last = m_routes[last].next;
+            }
+            m_routes[last].next = i;
+        }
+    }
+
+    // breadth first, children of a node are contiguous
+    std::vector<TrieNode *> order(1, &root);
+    m_nodes.resize(1);
+    for (size_t i = 0; i < order.size(); i++) {
+        TrieNode *n = order[i];
+        Node node;
+        node.label = m_labels.size();
+        node.label_len = n->label.size();
+        node.route = n->route;
+        m_labels += n->label;
+
+        node.first_child = order.size();
+        node.child_count = n->children.size();
+        order.insert(order.end(), n->children.begin(), n->children.end());
+        node.param = n->param ? (int)order.size() : -1;
+        if (n->param) {
+            order.push_back(n->param);
+        }
+        node.wild = n->wild ? (int)order.size() : -1;
+        if (n->wild) {
+            order.push_back(n->wild);
+        }
+
+        m_nodes.resize(order.size());
+        m_nodes[i] = node;
+    }
+
+    printf("*) %zu routes in %zu trie nodes\n", m_routes.size(), m_nodes.size());
+    return true;
+}
+
+int Router::find(int index, const char *path, int len, int pos, Slice *params, int *count) const {
+    const Node &node = m_nodes[index];
+    if (pos == len && node.route >= 0) {
+        return node.route;
+    }
+
+    // siblings never share a first byte, at most one static edge fits
+    for (int i = node.first_child; i < node.first_child + node.child_count; i++) {
+        const Node &child = m_nodes[i];
+        if (len - pos >= child.label_len && memcmp(path + pos, m_labels.data() + child.label, child.label_len) == 0) {
+            int route = find(i, path, len, pos + child.label_len, params, count);
+            if (route >= 0) {
+                return route;
+            }
+            break;
+        }
+    }
+
+    if (node.param >= 0 && pos < len && path[pos] != '/' && *count < ROUTE_MAX_PARAMS) {
+        int end = pos;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+        params[*count].data = path + pos;
+        params[*count].len = end - pos;
+        (*count)++;
+        int route = find(node.param, path, len, end, params, count);
+        if (route >= 0) {
+            return route;
+        }
+        (*count)--;
+    }
+
+    if (node.wild >= 0 && *count < ROUTE_MAX_PARAMS) {
+        params[*count].data = path + pos;
+        params[*count].len = len - pos;
+        (*count)++;
+        return m_nodes[node.wild].route;
+    }
+    return -1;
+}
+
+const Route *Router::match(METHOD method, const char *path, int len, RequestView *request, bool *allowed) const {
+    *allowed = true;
+    if (m_nodes.empty()) {
+        return NULL;
+    }
+
+    request->param_count = 0;
+    int index = find(0, path, len, 0, request->params, &request->param_count);
+    if (index < 0) {
+        return NULL;
+    }
+
+    for (; index >= 0; index = m_routes[index].next) {
+        const Route &route = m_routes[index];
+        if (route.methods == ANY_METHOD || (route.methods & METHOD_BIT(method))) {
+            return &route;
+        }
+    }
+    *allowed = false;
+    return NULL;
+}
+
+bool Router::runs_inline(const char *line, int len) const {
+    const char *end = line + len;
+    const char *space = (const char *)memchr(line, ' ', len);
+    if (!space) {
+        return false;
+    }
+    int method = method_of(line, space - line);
+
+    const char *path = space + 1;
+    const char *stop = path;
+    while (stop < end && *stop != ' ' && *stop != '?' && *stop != '\r') {
+        stop++;
+    }
+    if (method < 0 || stop == path || *path != '/') {
+        return false;
+    }
+
+    RequestView request;
+    bool allowed;
+    const Route *route = match((METHOD)method, path, stop - path, &request, &allowed);
+    return route && route->mode == HANDLER_INLINE;
+}
@@ -0,0 +1,419 @@
+#include <string.h>
+
+#include "hpack.h"
+
+// RFC 7541 Appendix A
+static const HeaderField static_table[HPACK_STATIC_ENTRIES] = {
+    HeaderField(":authority", ""),
+    HeaderField(":method", "GET"),
+    HeaderField(":method", "POST"),
+    HeaderField(":path", "/"),
+    HeaderField(":path", "/index.html"),
+    HeaderField(":scheme", "http"),
+    HeaderField(":scheme", "https"),
+    HeaderField(":status", "200"),
+    HeaderField(":status", "204"),
+    HeaderField(":status", "206"),
+    HeaderField(":status", "304"),
+    HeaderField(":status", "400"),
+    HeaderField(":status", "404"),
+    HeaderField(":status", "500"),
+    HeaderField("accept-charset", ""),
+    HeaderField("accept-encoding", "gzip, deflate"),
+    HeaderField("accept-language", ""),
+    HeaderField("accept-ranges", ""),
+    HeaderField("accept", ""),
+    HeaderField("access-control-allow-origin", ""),
+    HeaderField("age", ""),
+    HeaderField("allow", ""),
+    HeaderField("authorization", ""),
+    HeaderField("cache-control", ""),
+    HeaderField("content-disposition", ""),
+    HeaderField("content-encoding", ""),
+    HeaderField("content-language", ""),
+    HeaderField("content-length", ""),
+    HeaderField("content-location", ""),
+    HeaderField("content-range", ""),
+    HeaderField("content-type", ""),
+    HeaderField("cookie", ""),
+    HeaderField("date", ""),
+    HeaderField("etag", ""),
+    HeaderField("expect", ""),
+    HeaderField("expires", ""),
+    HeaderField("from", ""),
+    HeaderField("host", ""),
+    HeaderField("if-match", ""),
+    HeaderField("if-modified-since", ""),
+    HeaderField("if-none-match", ""),
+    HeaderField("if-range", ""),
+    HeaderField("if-unmodified-since", ""),
+    HeaderField("last-modified", ""),
+    HeaderField("link", ""),
+    HeaderField("location", ""),
+    HeaderField("max-forwards", ""),
+    HeaderField("proxy-authenticate", ""),
+    HeaderField("proxy-authorization", ""),
+    HeaderField("range", ""),
+    HeaderField("referer", ""),
+    HeaderField("refresh", ""),
+    HeaderField("retry-after", ""),
+    HeaderField("server", ""),
+    HeaderField("set-cookie", ""),
+    HeaderField("strict-transport-security", ""),
+    HeaderField("transfer-encoding", ""),
+    HeaderField("user-agent", ""),
+    HeaderField("vary", ""),
+    HeaderField("via", ""),
+    HeaderField("www-authenticate", "")};
+
+// RFC 7541 Appendix B code lengths, the code itself is canonical
+static const unsigned char huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30};
+
+#define HUFFMAN_MAX_BITS 30
+#define HUFFMAN_EOS 256
+
+// canonical decoding, codes of one length are consecutive and ordered by symbol
+class HuffmanTable {
+  public:
+    HuffmanTable() {
+        memset(m_count, 0, sizeof(m_count));
+        for (int sym = 0; sym <= HUFFMAN_EOS; sym++)
+            m_count[huffman_bits[sym]]++;
+
+        unsigned int code = 0;
+        int offset = 0;
+        for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+            m_first[len] = code;
+            m_offset[len] = offset;
+            offset += m_count[len];
+            code = (code + m_count[len]) << 1;
+        }
+
+        int next[HUFFMAN_MAX_BITS + 1];
+        memcpy(next, m_offset, sizeof(next));
+        for (int sym = 0; sym <= HUFFMAN_EOS; sym++)
+            m_symbols[next[huffman_bits[sym]]++] = sym;
+    }
+
+    bool decode(const unsigned char *data, int len, std::string &out) const {
+        unsigned int code = 0;
+        int bits = 0;
+
+        for (int i = 0; i < len; i++) {
+            for (int b = 7; b >= 0; b--) {
+                code = (code << 1) | ((data[i] >> b) & 1);
+                if (++bits > HUFFMAN_MAX_BITS) {
+                    return false;
+                }
+                if (code - m_first[bits] < (unsigned int)m_count[bits]) {
+                    int sym = m_symbols[m_offset[bits] + code - m_first[bits]];
+                    if (sym == HUFFMAN_EOS) {
+                        return false;
+                    }
+                    out += (char)sym;
+                    code = 0;
+                    bits = 0;
+                }
+            }
+        }
+
+        // padding is the most significant bits of EOS, all ones and short
+        return bits <= 7 && code == (1u << bits) - 1;
+    }
+
+  private:
+    unsigned int m_first[HUFFMAN_MAX_BITS + 1];
+    int m_count[HUFFMAN_MAX_BITS + 1];
+    int m_offset[HUFFMAN_MAX_BITS + 1];
+    unsigned short m_symbols[HUFFMAN_EOS + 1];
+};
+
+static const HuffmanTable huffman;
+
+static bool decode_int(const unsigned char *&p, const unsigned char *end, int prefix, unsigned int &value) {
+    if (p >= end) {
+        return false;
+    }
+
+    unsigned int max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max) {
+        return true;
+    }
+
+    for (int shift = 0; p < end; shift += 7) {
+        unsigned char b = *p++;
+        if (shift > 21) {
+            return false;
+        }
+        value += (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const unsigned char *&p, const unsigned char *end, std::string &out) {
+    if (p >= end) {
+        return false;
+    }
+
+    bool huffman_coded = (*p & 0x80) != 0;
+    unsigned int len;
+    if (!decode_int(p, end, 7, len) || len > (unsigned int)(end - p)) {
+        return false;
+    }
+
+    out.clear();
+    if (huffman_coded) {
+        if (!huffman.decode(p, len, out)) {
+            return false;
+        }
+    } else {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+static void encode_int(std::string &out, unsigned char head, int prefix, unsigned int value) {
+    unsigned int max = (1u << prefix) - 1;
+    if (value < max) {
+        out += (char)(head | value);
+        return;
+    }
+
+    out += (char)(head | max);
+    value -= max;
+    while (value >= 0x80) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+static void encode_string(std::string &out, const char *str) {
+    int len = strlen(str);
+    encode_int(out, 0, 7, len);
+    out.append(str, len);
+}
+
+/*
+    class HPackTable
+*/
+
+HPackTable::HPackTable() {
+    m_size = 0;
+    m_max_size = HPACK_TABLE_SIZE;
+}
+
+HPackTable::~HPackTable() {}
+
+// 1-based, the static table first and then the dynamic one, newest first
+const HeaderField *HPackTable::get(unsigned int index) const {
+    if (index == 0) {
+        return NULL;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        return static_table + index - 1;
+    }
+
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= m_entries.size()) {
+        return NULL;
+    }
+    return &m_entries[index];
+}
+
+// returns the best index, exact when the value matched too, 0 if none
+int HPackTable::find(const char *name, const char *value, bool &exact) const {
+    int found = 0;
+    exact = false;
+
+    for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (static_table[i].first != name) {
+            continue;
+        }
+        if (static_table[i].second == value) {
+            exact = true;
+            return i + 1;
+        }
+        if (!found) {
+            found = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        if (m_entries[i].first != name) {
+            continue;
+        }
+        if (m_entries[i].second == value) {
+            exact = true;
+            return HPACK_STATIC_ENTRIES + 1 + i;
+        }
+        if (!found) {
+            found = HPACK_STATIC_ENTRIES + 1 + i;
+        }
+    }
+
+    return found;
+}
+
+void HPackTable::add(const std::string &name, const std::string &value) {
+    int size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    if (size > m_max_size) {
+        // an entry larger than the table just empties it
+        evict(m_max_size);
+        return;
+    }
+
+    evict(size);
+    m_entries.push_front(HeaderField(name, value));
+    m_size += size;
+}
+
+void HPackTable::resize(int max_size) {
+    m_max_size = max_size;
+    evict(0);
+}
+
+void HPackTable::evict(int room) {
+    while (!m_entries.empty() && m_size + room > m_max_size) {
+        const HeaderField &last = m_entries.back();
+        m_size -= last.first.size() + last.second.size() + HPACK_ENTRY_OVERHEAD;
+        m_entries.pop_back();
+    }
+}
+
+/*
+    class HPackDecoder
+*/
+
+HPackDecoder::HPackDecoder() {}
+
+HPackDecoder::~HPackDecoder() {}
+
+bool HPackDecoder::decode(const unsigned char *data, int len, std::vector<HeaderField> &headers) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    unsigned int index;
+    std::string name, value;
+
+    while (p < end) {
+        unsigned char b = *p;
+
+        if (b & 0x80) {
+            // indexed header field
+            if (!decode_int(p, end, 7, index)) {
+                return false;
+            }
+            const HeaderField *field = m_table.get(index);
+            if (!field) {
+                return false;
+            }
+            headers.push_back(*field);
+            continue;
+        }
+
+        if ((b & 0xe0) == 0x20) {
+            // dynamic table size update, bounded by our SETTINGS_HEADER_TABLE_SIZE
+            if (!decode_int(p, end, 5, index) || index > HPACK_TABLE_SIZE) {
+                return false;
+            }
+            m_table.resize(index);
+            continue;
+        }
+
+        // literal, with incremental indexing or without / never indexed
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!decode_int(p, end, indexing ? 6 : 4, index)) {
+            return false;
+        }
+
+        if (index) {
+            const HeaderField *field = m_table.get(index);
+            if (!field) {
+                return false;
+            }
+            name = field->first;
+        } else if (!decode_string(p, end, name)) {
+            return false;
+        }
+
+        if (!decode_string(p, end, value)) {
+            return false;
+        }
+
+        if (indexing) {
+            m_table.add(name, value);
+        }
+        headers.push_back(HeaderField(name, value));
+    }
+
+    return true;
+}
+
+/*
+    class HPackEncoder
+*/
+
+HPackEncoder::HPackEncoder() {
+    m_pending_size = -1;
+}
+
+HPackEncoder::~HPackEncoder() {}
+
+// the peer limit only ever shrinks our table, the update goes out with the next block
+void HPackEncoder::resize(int max_size) {
+    if (max_size > HPACK_TABLE_SIZE) {
+        max_size = HPACK_TABLE_SIZE;
+    }
+    if (max_size != m_table.max_size()) {
+        m_table.resize(max_size);
+        m_pending_size = max_size;
+    }
+}
+
+void HPackEncoder::encode(const char *name, const char *value, bool index, std::string &block) {
+    if (m_pending_size >= 0) {
+        encode_int(block, 0x20, 5, m_pending_size);
+        m_pending_size = -1;
+    }
+
+    bool exact;
+    int found = m_table.find(name, value, exact);
+    if (exact) {
+        encode_int(block, 0x80, 7, found);
+        return;
+    }
+
+    if (index) {
+        encode_int(block, 0x40, 6, found);
+        m_table.add(name, value);
+    } else {
+        encode_int(block, 0x00, 4, found);
+    }
+
+    if (!found) {
+        encode_string(block, name);
+    }
+    encode_string(block, value);
+}
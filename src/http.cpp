@@ -1,14 +1,15 @@
 #include "http.h"
+#include "http2.h"
 #include "threadpool.h"
 
-inline int set_nonblocking(int fd) {
+int set_nonblocking(int fd) {
     int opt = fcntl(fd, F_GETFL);
     return fcntl(fd, F_SETFL, opt | O_NONBLOCK);
 }
 
-static void add_fd(int epoll_fd, int fd, bool one_shot) {
+void add_fd(int epoll_fd, int fd, bool one_shot, uint32_t gen) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = EVENT_TOKEN(fd, gen);
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (one_shot) {
         event.events |= EPOLLONESHOT;
@@ -17,14 +18,14 @@ static void add_fd(int epoll_fd, int fd, bool one_shot) {
     set_nonblocking(fd);
 }
 
-static void remove_fd(int epoll_fd, int fd) {
+void remove_fd(int epoll_fd, int fd) {
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
     close(fd);
 }
 
-static void mod_fd(int epoll_fd, int fd, int ev) {
+void mod_fd(int epoll_fd, int fd, int ev, uint32_t gen) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = EVENT_TOKEN(fd, gen);
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
 }
@@ -33,24 +34,120 @@ static void mod_fd(int epoll_fd, int fd, int ev) {
     class HTTPServer
 */
 
-HTTPServer::HTTPServer(const char *host, int port, const char *path) {
-    // address init
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    inet_pton(AF_INET, host, &(address.sin_addr));
-    address.sin_port = htons(port);
+volatile sig_atomic_t HTTPServer::reload_pending = 0;
+volatile sig_atomic_t HTTPServer::shutdown_pending = 0;
+volatile sig_atomic_t HTTPServer::upgrade_pending = 0;
 
+HTTPServer::HTTPServer(const char *path) {
     // serve dir
     strncpy(doc_root, path, FILENAME_LEN);
+    root_fd = -1;
+    epoll_fd = -1;
+    warm_fraction = 1.0;
+    upgrade_argv = NULL;
+    upgrade_fd = -1;
+    upgrade_pid = -1;
+    draining = false;
+    drain_timeout = DRAIN_TIMEOUT;
+    drain_deadline = 0;
+    threads = DEFAULT_THREAD_NUMBER;
+    stale_events = 0;
 
     // init message
-    printf("*) HTTPD serve %s and listen at %s:%d\n", doc_root, host, port);
+    printf("*) HTTPD serve %s\n", doc_root);
+}
+
+bool HTTPServer::add_listener(const char *spec) {
+    if (listeners.size() >= MAX_LISTENERS) {
+        return false;
+    }
+    Listener *listener = new Listener;
+    if (!listener->parse(spec)) {
+        delete listener;
+        return false;
+    }
+    listeners.push_back(listener);
+    return true;
+}
+
+bool HTTPServer::route(int methods, const char *pattern, Handler handler, void *arg, HANDLER_MODE mode) {
+    return router.add(methods, pattern, handler, arg, mode);
+}
+
+bool HTTPServer::add_proxy(const char *spec) {
+    return proxy.add_route(spec);
+}
+
+bool HTTPServer::load_bundle(const char *path) {
+    return bundles.load(path);
+}
+
+bool HTTPServer::load_warm_manifest(const char *path, double fraction) {
+    warm_fraction = fraction;
+    return warmer.load(path);
+}
+
+void HTTPServer::record_access(const char *path) {
+    recorder.open(path);
+    printf("*) recording hot paths to %s\n", path);
+}
+
+void HTTPServer::configure_writes(long quantum, long conn_rate, long global_rate) {
+    scheduler.configure(quantum, conn_rate, global_rate);
+}
+
+void HTTPServer::enable_trace(const char *path, int rate) {
+    timeline.configure(path, rate);
+    printf("*) tracing 1 in %d requests to %s\n", rate, path);
+}
+
+void HTTPServer::enable_upgrade(char **argv) {
+    upgrade_argv = argv;
+}
+
+void HTTPServer::set_drain_timeout(int seconds) {
+    drain_timeout = seconds;
+}
+
+void HTTPServer::set_threads(int threads) {
+    this->threads = threads;
+}
+
+bool HTTPServer::set_index(const char *names) {
+    return dirs.set_names(names);
+}
+
+void HTTPServer::enable_listings() {
+    dirs.enable_listings();
+}
+
+void HTTPServer::configure_large_files(off_t threshold, int keep_hits) {
+    large_files.configure(threshold, keep_hits);
+}
+
+bool HTTPServer::add_vhost(const char *spec) {
+    return vhosts.add(spec);
+}
+
+bool HTTPServer::enable_tls(const char *cert, const char *key) {
+    if (!tls.load(cert, key)) {
+        return false;
+    }
+    printf("*) TLS enabled with %s\n", cert);
+    return true;
 }
 
 HTTPServer::~HTTPServer() {
     // release resources
-    close(epoll_fd);
-    close(listen_fd);
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    for (size_t i = 0; i < listeners.size(); i++) {
+        delete listeners[i];
+    }
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
 }
 
 void HTTPServer::show_error(int conn_fd, const char *info) {
@@ -59,85 +156,736 @@ void HTTPServer::show_error(int conn_fd, const char *info) {
     close(conn_fd);
 }
 
+Listener *HTTPServer::listener_of(int fd) {
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i]->m_fd == fd) {
+            return listeners[i];
+        }
+    }
+    return NULL;
+}
+
+// edge triggered, drain the backlog or the rest waits for the next client
+void HTTPServer::accept_all(Listener *listener, HTTPConn *conns) {
+    while (true) {
+        struct sockaddr_storage client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int conn_fd = accept4(listener->m_fd, (struct sockaddr *)&client_address, &client_addrlength, SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("errno is: %d\n", errno);
+            }
+            break;
+        }
+        if (HTTPConn::m_conn_count.load() >= MAX_FD || conn_fd >= MAX_FD) {
+            show_error(conn_fd, "Internal server busy");
+            continue;
+        }
+        conns[conn_fd].init(conn_fd, client_address);
+    }
+}
+
+// the new process gets the listening sockets over a socketpair on UPGRADE_FD
+bool HTTPServer::start_upgrade() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        printf("error: cannot start upgrade: %s\n", strerror(errno));
+        return false;
+    }
+
+    // built before fork, the child may only make async-signal-safe calls
+    char env_var[] = UPGRADE_ENV "=3";
+    std::vector<char *> env;
+    for (char **e = environ; *e; e++) {
+        if (strncmp(*e, UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+            env.push_back(*e);
+        }
+    }
+    env.push_back(env_var);
+    env.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("error: cannot start upgrade: %s\n", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        // nothing but the socket survives exec, client sockets would stay half open
+        if (pair[1] == UPGRADE_FD) {
+            fcntl(UPGRADE_FD, F_SETFD, 0);
+        } else {
+            dup2(pair[1], UPGRADE_FD);
+        }
+        if (syscall(SYS_close_range, UPGRADE_FD + 1, ~0U, 0) < 0) {
+            for (int fd = UPGRADE_FD + 1; fd < MAX_FD; fd++) {
+                close(fd);
+            }
+        }
+        execvpe(upgrade_argv[0], upgrade_argv, env.data());
+        _exit(127);
+    }
+
+    close(pair[1]);
+    if (!send_listeners(pair[0], listeners)) {
+        printf("error: cannot pass the listeners to process %d\n", pid);
+        close(pair[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+    upgrade_fd = pair[0];
+    upgrade_pid = pid;
+    add_fd(epoll_fd, upgrade_fd, false);
+    printf("*) upgrading to process %d\n", pid);
+    return true;
+}
+
+// one byte once the new process accepts, EOF when it gave up
+void HTTPServer::finish_upgrade(HTTPConn *conns) {
+    char ready = 0;
+    ssize_t n = ::read(upgrade_fd, &ready, 1);
+    remove_fd(epoll_fd, upgrade_fd);
+    upgrade_fd = -1;
+
+    if (n == 1) {
+        printf("*) process %d took over\n", upgrade_pid);
+        drain(conns, true);
+    } else {
+        printf("error: upgrade to process %d failed\n", upgrade_pid);
+        waitpid(upgrade_pid, NULL, 0);
+    }
+    upgrade_pid = -1;
+}
+
+// started by an upgrade, adopt the old listening sockets
+void HTTPServer::take_over() {
+    const char *env = getenv(UPGRADE_ENV);
+    if (!env) {
+        return;
+    }
+    upgrade_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+
+    int count = receive_listeners(upgrade_fd, listeners);
+    printf("*) took over %d listeners from process %d\n", count, getppid());
+}
+
+// stop accepting, close what is idle, let the rest finish
+void HTTPServer::drain(HTTPConn *conns, bool handed_over) {
+    if (draining) {
+        return;
+    }
+    draining = true;
+    drain_deadline = time(NULL) + drain_timeout;
+    HTTPConn::m_draining = true;
+
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i]->m_fd < 0) {
+            continue;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listeners[i]->m_fd, 0);
+        // the unix socket file now belongs to the new process
+        if (handed_over) {
+            listeners[i]->release();
+        } else {
+            listeners[i]->close();
+        }
+    }
+
+    // a connection a worker holds is not idle, the claim makes sure it stays so
+    for (int fd = 0; fd < MAX_FD; fd++) {
+        if (conns[fd].idle() && conns[fd].claim()) {
+            conns[fd].close_idle();
+        }
+    }
+    printf("*) draining %d connections\n", HTTPConn::m_conn_count.load());
+}
+
+// an fd closed and accepted again earlier in the same batch keeps its old events,
+// the generation tells them apart and the owner shows the connection is armed
+HTTPConn *HTTPServer::claim(HTTPConn *conns, uint64_t token) {
+    HTTPConn *conn = conns + EVENT_FD(token);
+    if (conn->generation() != EVENT_GEN(token) || !conn->claim()) {
+        stale_events++;
+        return NULL;
+    }
+    return conn;
+}
+
 int HTTPServer::serve_forever() {
     HTTPConn *conns;
     threadpool<HTTPConn> *pool = NULL;
     // create threadpool
     try {
-        pool = new threadpool<HTTPConn>;
+        pool = new threadpool<HTTPConn>(threads);
     } catch (...) {
         return 1;
     }
 
-    conns = new HTTPConn[MAX_FD];
-    assert(conns);
+    // every request resolves beneath this fd instead of walking doc_root again,
+    // a bundle has the whole tree and needs none
+    root_fd = open(doc_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0 && !bundles.enabled()) {
+        printf("error: cannot open %s\n", doc_root);
+        delete pool;
+        return 1;
+    }
 
-    for (int i = 0; i < MAX_FD; i++)
-        (conns + i)->doc_root = doc_root;
+    router.compile();
 
-    int conn_count = 0;
+    // the proxy relays HTTP/1.1 connections only, TLS clients must not pick h2 under its routes
+    if (tls.enabled() && proxy.enabled()) {
+        tls.offer_h2(false);
+        printf("*) proxy routes set, ALPN offers http/1.1 only\n");
+    }
 
-    listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listen_fd >= 0);
+    if (!vhosts.open() || !dirs.open()) {
+        delete pool;
+        return 1;
+    }
 
-    int ret = 0, flag = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-    ret = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
-    assert(ret >= 0);
+    conns = new HTTPConn[MAX_FD];
+    assert(conns);
 
-    ret = listen(listen_fd, 20);
-    assert(ret >= 0);
+    for (int i = 0; i < MAX_FD; i++) {
+        (conns + i)->root_fd = root_fd;
+        (conns + i)->proxy = &proxy;
+        (conns + i)->router = &router;
+        (conns + i)->scheduler = &scheduler;
+        (conns + i)->tls = &tls;
+        (conns + i)->bundles = &bundles;
+        (conns + i)->vhosts = &vhosts;
+        (conns + i)->dirs = &dirs;
+        (conns + i)->large_files = &large_files;
+        (conns + i)->recorder = &recorder;
+        (conns + i)->timeline = &timeline;
+    }
+
+    // nothing is accepted before the gate, the rest warms while serving
+    if (warmer.enabled()) {
+        warmer.start(root_fd, &bundles);
+        warmer.wait(warm_fraction);
+    }
+
+    // after an upgrade only listeners new on the command line are opened
+    take_over();
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i]->m_fd < 0 && !listeners[i]->open()) {
+            delete[] conns;
+            delete pool;
+            return 1;
+        }
+    }
 
     epoll_event events[MAX_EVENT_NUMBER];
-    int epoll_fd = epoll_create(5);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     assert(epoll_fd != -1);
-    add_fd(epoll_fd, listen_fd, false);
+    for (size_t i = 0; i < listeners.size(); i++) {
+        add_fd(epoll_fd, listeners[i]->m_fd, false);
+    }
+    if (dirs.watch_fd() >= 0) {
+        add_fd(epoll_fd, dirs.watch_fd(), false);
+    }
     HTTPConn::m_epoll_fd = epoll_fd;
 
+    // the old process stops accepting once we do
+    if (upgrade_fd >= 0) {
+        if (::write(upgrade_fd, "1", 1) != 1) {
+            printf("error: cannot tell process %d we are ready\n", getppid());
+        }
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+
     while (true) {
-        int number = epoll_wait(epoll_fd, events, MAX_EVENT_NUMBER, -1);
+        int timeout = scheduler.timeout();
+        if (timeout < 0 && recorder.enabled()) {
+            timeout = WARM_RECORD_INTERVAL * 1000;
+        }
+        if (draining && (timeout < 0 || timeout > 1000)) {
+            timeout = 1000;
+        }
+        int number = epoll_wait(epoll_fd, events, MAX_EVENT_NUMBER, timeout);
         if ((number < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
         }
 
+        if (reload_pending) {
+            reload_pending = 0;
+            if (bundles.enabled()) {
+                bundles.reload();
+            }
+            vhosts.reload();
+            if (recorder.enabled()) {
+                recorder.dump();
+            }
+            scheduler.report();
+            dirs.report();
+            large_files.report();
+            timeline.dump();
+            printf("*) %ld stale events dropped\n", stale_events);
+        }
+        if (shutdown_pending) {
+            shutdown_pending = 0;
+            drain(conns, false);
+        }
+        if (upgrade_pending) {
+            upgrade_pending = 0;
+            if (!upgrade_argv || draining || upgrade_fd >= 0 || !start_upgrade()) {
+                printf("error: no upgrade now\n");
+            }
+        }
+        scheduler.tick();
+        if (recorder.enabled()) {
+            recorder.tick();
+        }
+
         for (int i = 0; i < number; ++i) {
-            int sock_fd = events[i].data.fd;
-            if (sock_fd == listen_fd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int conn_fd = accept(listen_fd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (conn_fd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if (HTTPConn::m_conn_count >= MAX_FD) {
-                    show_error(conn_fd, "Internal server busy");
-                    continue;
+            uint64_t token = events[i].data.u64;
+            int sock_fd = EVENT_FD(token);
+            if (EVENT_GEN(token) == 0) {
+                // generation 0 is never a client, a stale one falls through
+                Listener *listener = listener_of(sock_fd);
+                if (sock_fd == upgrade_fd) {
+                    finish_upgrade(conns);
+                } else if (sock_fd == dirs.watch_fd()) {
+                    dirs.on_watch();
+                } else if (listener) {
+                    accept_all(listener, conns);
+                } else if (proxy.owns(sock_fd)) {
+                    proxy.handle(sock_fd, events[i].events);
+                } else {
+                    stale_events++;
                 }
+                continue;
+            }
 
-                conns[conn_fd].init(conn_fd, client_address);
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                conns[sock_fd].close_conn();
+            HTTPConn *conn = claim(conns, token);
+            if (!conn) {
+                continue;
+            }
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                conn->close_conn();
+            } else if (conn->handshaking()) {
+                // the worker drives the handshake whichever way it is blocked
+                conn->to_worker();
+                if (!pool->append(conn)) {
+                    conn->close_conn();
+                }
+            } else if (conn->is_http2()) {
+                // frames go out from here, incoming ones are parsed by a worker
+                bool ok = !(events[i].events & EPOLLOUT) || conn->flush();
+                if (ok && ((events[i].events & EPOLLIN) || conn->tls_pending())) {
+                    ok = conn->read();
+                    if (ok) {
+                        conn->to_worker();
+                        ok = pool->append(conn);
+                    }
+                } else if (ok) {
+                    conn->rearm(true);
+                }
+                if (!ok) {
+                    conn->close_conn();
+                }
             } else if (events[i].events & EPOLLIN) {
-                if (conns[sock_fd].read()) {
-                    pool->append(conns + sock_fd);
+                if (!conn->read()) {
+                    conn->close_conn();
+                } else if (conn->runs_inline()) {
+                    conn->process();
                 } else {
-                    conns[sock_fd].close_conn();
+                    conn->mark(STAGE_QUEUED);
+                    conn->to_worker();
+                    if (!pool->append(conn)) {
+                        conn->close_conn();
+                    }
                 }
             } else if (events[i].events & EPOLLOUT) {
-                if (!conns[sock_fd].write()) {
-                    conns[sock_fd].close_conn();
+                if (!conn->write()) {
+                    conn->close_conn();
+                } else if (conn->stream_pending()) {
+                    conn->to_worker();
+                    if (!pool->append(conn)) {
+                        conn->close_conn();
+                    }
                 }
             } else {
             }
         }
+
+        if (draining && (HTTPConn::m_conn_count == 0 || time(NULL) >= drain_deadline)) {
+            break;
+        }
+    }
+
+    if (draining) {
+        printf("*) drained, %d connections cut off\n", HTTPConn::m_conn_count.load());
     }
+    timeline.dump();
 
+    // a worker may still hold a connection cut off by the deadline
     delete pool;
-    delete[] conns;
+    if (HTTPConn::m_conn_count == 0) {
+        delete[] conns;
+    }
+
+    return draining ? 0 : 1;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// percent-decodes and folds "." and "..", the result is relative to doc_root
+bool normalize_url(const char *url, char *path, int size) {
+    if (url[0] != '/') {
+        return false;
+    }
+
+    int len = 0;
+    const char *p = url;
+    while (*p && *p != '?' && *p != '#') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+
+        int mark = len;
+        if (len > 0) {
+            if (len >= size - 1) {
+                return false;
+            }
+            path[len++] = '/';
+        }
+
+        int start = len;
+        while (*p && *p != '/' && *p != '?' && *p != '#') {
+            char c = *p++;
+            if (c == '%') {
+                int hi = hex_value(p[0]);
+                int lo = (hi < 0) ? -1 : hex_value(p[1]);
+                if (lo < 0) {
+                    return false;
+                }
+                c = (hi << 4) | lo;
+                p += 2;
+                // an encoded NUL or separator never names a file
+                if (c == 0 || c == '/') {
+                    return false;
+                }
+            }
+            if (len >= size - 1) {
+                return false;
+            }
+            path[len++] = c;
+        }
+
+        int seg = len - start;
+        if (seg == 1 && path[start] == '.') {
+            len = mark;
+        } else if (seg == 2 && path[start] == '.' && path[start + 1] == '.') {
+            // climbing above the root is refused, not clamped
+            if (mark == 0) {
+                return false;
+            }
+            len = mark;
+            while (len > 0 && path[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        }
+    }
+
+    if (len == 0) {
+        path[len++] = '.';
+    }
+    path[len] = 0;
+    return true;
+}
+
+// a "." or ".." segment, escaped or not, matching on such a path would be fooled
+static bool has_dot_segment(const char *url) {
+    const char *p = url;
+    while (*p == '/') {
+        int dots = 0;
+        bool other = false;
+        p++;
+        while (*p && *p != '/' && *p != '?' && *p != '#') {
+            if (p[0] == '%' && p[1] == '2' && (p[2] | 0x20) == 'e') {
+                dots++;
+                p += 3;
+            } else {
+                dots += (*p == '.');
+                other |= (*p != '.');
+                p++;
+            }
+        }
+        if (!other && (dots == 1 || dots == 2)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool canonical_url(const char *url, char *out, int size) {
+    char path[FILENAME_LEN];
+    if (!normalize_url(url, path, sizeof(path))) {
+        return false;
+    }
+
+    // "dir/", "dir/." and "dir/.." still ask for a directory
+    int end = strcspn(url, "?#");
+    const char *last = url + end;
+    while (last > url && last[-1] != '/') {
+        last--;
+    }
+    int seg = url + end - last;
+    bool slash = seg == 0 || (seg == 1 && last[0] == '.') || (seg == 2 && last[0] == '.' && last[1] == '.');
+
+    int len = 0;
+    out[len++] = '/';
+    if (strcmp(path, ".") != 0) {
+        for (const char *p = path; *p; p++) {
+            unsigned char c = *p;
+            if (len + 4 >= size) {
+                return false;
+            }
+            if (isalnum(c) || strchr("-._~!$&'()*+,;=:@/", c)) {
+                out[len++] = c;
+            } else {
+                len += snprintf(out + len, 4, "%%%02X", c);
+            }
+        }
+        if (slash) {
+            out[len++] = '/';
+        }
+    }
+
+    // the query goes on as it came, the fragment is the client's
+    int query = (url[end] == '?') ? strcspn(url + end, "#") : 0;
+    if (len + query >= size) {
+        return false;
+    }
+    memcpy(out + len, url + end, query);
+    out[len + query] = 0;
+    return true;
+}
+
+// one path walk from the doc_root fd, RESOLVE_BENEATH also jails symlinks
+int open_beneath(int root_fd, const char *path) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+
+    // kernels before 5.6 walk one component at a time and follow no symlink at all
+    char name[FILENAME_LEN];
+    int dir = root_fd;
+    const char *p = path;
+    while (true) {
+        int len = strcspn(p, "/");
+        int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW | (p[len] ? O_DIRECTORY : 0);
+        if (len >= (int)sizeof(name)) {
+            errno = ENAMETOOLONG;
+            fd = -1;
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            errno = EXDEV;
+            fd = -1;
+        } else {
+            memcpy(name, p, len);
+            name[len] = 0;
+            fd = openat(dir, name, flags);
+        }
+
+        int err = errno;
+        if (dir != root_fd) {
+            close(dir);
+        }
+        errno = err;
+        if (fd < 0 || !p[len]) {
+            return fd;
+        }
+        dir = fd;
+        p += len + 1;
+    }
+}
+
+// opens path beneath root_fd, FILE_REQUEST leaves fd open on a readable file or directory
+static HTTP_CODE open_path(int root_fd, const char *path, struct stat *st, int *fd) {
+    *fd = open_beneath(root_fd, path);
+    if (*fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG) {
+            return NO_RESOURCE;
+        }
+        // EXDEV or ELOOP when a link leads out of doc_root
+        return FORBIDDEN_REQUEST;
+    }
+
+    if (fstat(*fd, st) < 0) {
+        close(*fd);
+        return INTERNAL_ERROR;
+    }
+
+    if (!(st->st_mode & S_IROTH) || !(S_ISREG(st->st_mode) || S_ISDIR(st->st_mode))) {
+        close(*fd);
+        return FORBIDDEN_REQUEST;
+    }
+    return FILE_REQUEST;
+}
+
+// takes fd over, an empty file is a FILE_REQUEST without a mapping
+static HTTP_CODE map_regular(int fd, const char *path, struct stat *st, char **address, const char **type,
+                             ReadAhead *readahead) {
+    *type = mime_type(path);
+    if (st->st_size == 0) {
+        close(fd);
+        return FILE_REQUEST;
+    }
+
+    // a body sent from the readahead fd is never mapped
+    if (readahead->files->streams(*st)) {
+        readahead->start(fd, *st);
+        if (readahead->active() && readahead->sendfile) {
+            close(fd);
+            return FILE_REQUEST;
+        }
+    }
+
+    *address = (char *)mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    return 0;
+    if (*address == MAP_FAILED) {
+        readahead->stop();
+        *address = NULL;
+        return INTERNAL_ERROR;
+    }
+    return FILE_REQUEST;
+}
+
+// "dir" goes to "dir/" first, so relative links in the index or listing resolve
+static HTTP_CODE map_directory(int root_fd, int fd, const char *url, const char *path, DirIndex *dirs, bool json,
+                               struct stat *st, char **address, const char **type, Listing **listing,
+                               ReadAhead *readahead) {
+    int len = strcspn(url, "?#");
+    if (url[len - 1] != '/') {
+        return MOVED_PERMANENTLY;
+    }
+
+    const std::vector<std::string> &names = dirs->names();
+    for (size_t i = 0; i < names.size(); i++) {
+        char index[FILENAME_LEN];
+        if (snprintf(index, sizeof(index), "%s/%s", path, names[i].c_str()) >= (int)sizeof(index)) {
+            continue;
+        }
+        struct stat index_st;
+        int index_fd;
+        HTTP_CODE ret = open_path(root_fd, index, &index_st, &index_fd);
+        if (ret == NO_RESOURCE) {
+            continue;
+        }
+        if (ret == FILE_REQUEST && S_ISDIR(index_st.st_mode)) {
+            close(index_fd);
+            continue;
+        }
+        if (ret == FILE_REQUEST) {
+            *st = index_st;
+            ret = map_regular(index_fd, index, st, address, type, readahead);
+        }
+        return ret;
+    }
+
+    if (!dirs->listings()) {
+        return FORBIDDEN_REQUEST;
+    }
+    *listing = dirs->listing(fd, *st, path, json);
+    if (!*listing) {
+        return INTERNAL_ERROR;
+    }
+    *address = (char *)(*listing)->data();
+    *type = (*listing)->type();
+    st->st_size = (*listing)->size();
+    return FILE_REQUEST;
+}
+
+// shared by HTTP/1.1 and HTTP/2 to resolve and map a file under doc_root
+HTTP_CODE map_file(int root_fd, const char *url, DirIndex *dirs, bool json, struct stat *st, char **address,
+                   const char **type, Listing **listing, ReadAhead *readahead) {
+    *address = NULL;
+    *listing = NULL;
+
+    char path[FILENAME_LEN];
+    if (!normalize_url(url, path, sizeof(path))) {
+        return BAD_REQUEST;
+    }
+
+    int fd;
+    HTTP_CODE ret = open_path(root_fd, path, st, &fd);
+    if (ret != FILE_REQUEST) {
+        return ret;
+    }
+
+    if (S_ISDIR(st->st_mode)) {
+        ret = map_directory(root_fd, fd, url, path, dirs, json, st, address, type, listing, readahead);
+        close(fd);
+        return ret;
+    }
+    return map_regular(fd, path, st, address, type, readahead);
+}
+
+// same normalized path as map_file, answered from the mapped bundle
+HTTP_CODE map_bundle(BundleStore *bundles, const DirIndex *dirs, const char *url, int accept, const char *if_none_match,
+                     BundleFile *file) {
+    char path[FILENAME_LEN];
+    if (!normalize_url(url, path, sizeof(path))) {
+        return BAD_REQUEST;
+    }
+
+    // a bundle has no directories, one is known by its index file
+    if (!bundles->lookup(path, accept, file)) {
+        const char *dir = (strcmp(path, ".") == 0) ? "" : path;
+        const std::vector<std::string> &names = dirs->names();
+        size_t i = 0;
+        for (; i < names.size(); i++) {
+            char index[FILENAME_LEN];
+            int n = snprintf(index, sizeof(index), "%s%s%s", dir, *dir ? "/" : "", names[i].c_str());
+            if (n < (int)sizeof(index) && bundles->lookup(index, accept, file)) {
+                break;
+            }
+        }
+        if (i == names.size()) {
+            return NO_RESOURCE;
+        }
+        int len = strcspn(url, "?#");
+        if (url[len - 1] != '/') {
+            file->bundle->unref();
+            file->bundle = NULL;
+            return MOVED_PERMANENTLY;
+        }
+    }
+
+    if (if_none_match && bundle_etag_match(if_none_match, file->etag)) {
+        return NOT_MODIFIED;
+    }
+    return FILE_REQUEST;
 }
 
 /*
@@ -145,27 +893,74 @@ int HTTPServer::serve_forever() {
 */
 
 // static variable init
-int HTTPConn::m_conn_count = 0;
+std::atomic<int> HTTPConn::m_conn_count(0);
 int HTTPConn::m_epoll_fd = -1;
+std::atomic<bool> HTTPConn::m_draining(false);
 
 void HTTPConn::close_conn(bool real_close) {
     if (real_close && (m_sock_fd != -1)) {
-        //mod_fd( m_epoll_fd, m_sock_fd, EPOLLIN );
-        remove_fd(m_epoll_fd, m_sock_fd);
+        proxy->detach(this);
+        scheduler->forget(this, &m_write_state);
+        unmap();
+        if (m_response) {
+            m_response->cancel();
+            delete m_response;
+            m_response = NULL;
+        }
+        delete m_request;
+        m_request = NULL;
+        delete m_h2;
+        m_h2 = NULL;
+        m_traced = false;
+        if (m_ssl) {
+            if (!m_handshaking) {
+                SSL_shutdown(m_ssl);
+            }
+            SSL_free(m_ssl);
+            m_ssl = NULL;
+        }
+        // the fd may be accepted again as soon as it is closed, so the
+        // slot is given up first and not touched after remove_fd
+        int sock_fd = m_sock_fd;
         m_sock_fd = -1;
+        m_owner.store(OWNER_NONE, std::memory_order_release);
+        remove_fd(m_epoll_fd, sock_fd);
         --m_conn_count;
     }
 }
 
-void HTTPConn::init(int sock_fd, const sockaddr_in &addr) {
+void HTTPConn::init(int sock_fd, const sockaddr_storage &addr) {
     m_sock_fd = sock_fd;
     m_address = addr;
+    format_address(&m_address, m_peer, sizeof(m_peer), true);
+    m_upstream = NULL;
+    m_h2 = NULL;
+    m_ssl = NULL;
+    m_handshaking = false;
+    m_ktls_send = false;
+    m_tls_retry = 0;
+    m_file_address = NULL;
+    m_bundle_file.bundle = NULL;
+    m_request = NULL;
+    m_response = NULL;
+    m_readahead.files = large_files;
+    scheduler->reset(&m_write_state);
+    if (tls->enabled()) {
+        m_ssl = tls->accept(sock_fd);
+        m_handshaking = (m_ssl != NULL);
+    }
+    m_idle = !m_handshaking;
+    m_traced = false;
     int error = 0;
     socklen_t len = sizeof(error);
     getsockopt(m_sock_fd, SOL_SOCKET, SO_ERROR, &error, &len);
     int reuse = 1;
     setsockopt(m_sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    add_fd(m_epoll_fd, sock_fd, true);
+    if (++m_generation == 0) {
+        m_generation = 1;
+    }
+    m_owner.store(OWNER_EPOLL, std::memory_order_release);
+    add_fd(m_epoll_fd, sock_fd, true, m_generation);
     m_conn_count++;
 
     init();
@@ -174,19 +969,34 @@ void HTTPConn::init(int sock_fd, const sockaddr_in &addr) {
 void HTTPConn::init() {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
+    m_upgrade_h2c = false;
+    m_h2_settings = nullptr;
 
     m_method = GET;
     m_url = nullptr;
+    m_target = nullptr;
     m_version = nullptr;
     m_content_length = 0;
     m_host = nullptr;
+    m_content_type = MIME_DEFAULT;
+    m_accept = 0;
+    m_if_none_match = nullptr;
+    m_accept_json = false;
+    m_site = nullptr;
+    m_sendfile = false;
+    m_route = nullptr;
+    m_route_denied = false;
+    m_stream_pending = false;
+    m_proxy_route = nullptr;
+    m_proxy_tries = 0;
     m_start_line = 0;
+    m_header_start = 0;
+    m_header_end = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
     memset(m_read_buf, 0, BUFFER_SIZE);
     memset(m_write_buf, 0, BUFFER_SIZE);
-    memset(m_real_file, 0, FILENAME_LEN);
 }
 
 LINE_STATUS HTTPConn::parse_line() {
@@ -217,13 +1027,22 @@ LINE_STATUS HTTPConn::parse_line() {
 }
 
 bool HTTPConn::read() {
+    m_idle = false;
+    if (m_h2) {
+        return m_h2->read();
+    }
+
+    if (m_read_idx == 0) {
+        begin_span();
+    }
+
     if (m_read_idx >= BUFFER_SIZE) {
         return false;
     }
 
     int bytes_read = 0;
-    while (true) {
-        bytes_read = recv(m_sock_fd, m_read_buf + m_read_idx, BUFFER_SIZE - m_read_idx, 0);
+    while (m_read_idx < BUFFER_SIZE) {
+        bytes_read = recv_some(m_read_buf + m_read_idx, BUFFER_SIZE - m_read_idx);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
@@ -245,13 +1064,12 @@ HTTP_CODE HTTPConn::parse_request_line(char *text) {
     }
     *m_url++ = 0;
 
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0) {
-        m_method = GET;
-    } else {
-        // GET only for now
+    // anything but GET is only taken by a handler, do_request() checks
+    int method = method_of(text, strlen(text));
+    if (method < 0) {
         return BAD_REQUEST;
     }
+    m_method = (METHOD)method;
 
     m_url += strspn(m_url, " \t");
     m_version = strpbrk(m_url, " \t");
@@ -273,23 +1091,68 @@ HTTP_CODE HTTPConn::parse_request_line(char *text) {
         return BAD_REQUEST;
     }
 
+    // the proxy forwards the target as sent, routes, sites and files see it canonical
+    m_target = m_url;
+    if (canonical_url(m_url, m_canonical, sizeof(m_canonical))) {
+        m_url = m_canonical;
+    } else if (has_dot_segment(m_url) || !proxy->match(m_url)) {
+        // an encoded slash or an overlong path names no file, an upstream may still take it
+        return BAD_REQUEST;
+    }
+
+    if (router->enabled() && m_url == m_canonical) {
+        if (!m_request) {
+            m_request = new RequestView;
+        }
+        int len = strcspn(m_url, "?#");
+        m_request->method = m_method;
+        m_request->path.data = m_url;
+        m_request->path.len = len;
+        m_request->query.data = m_url + len + (m_url[len] == '?');
+        m_request->query.len = (m_url[len] == '?') ? strcspn(m_url + len + 1, "#") : 0;
+        m_request->body.data = "";
+        m_request->body.len = 0;
+        m_request->header_count = 0;
+
+        bool allowed;
+        m_route = router->match(m_method, m_url, len, m_request, &allowed);
+        m_route_denied = !allowed;
+    }
+
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
 HTTP_CODE HTTPConn::parse_headers(char *text) {
     if (text[0] == 0) {
+        m_header_end = text - m_read_buf;
+
         if (m_method == HEAD) {
             return GET_REQUEST;
         }
 
+        // the body and its terminating NUL have to fit behind the head
+        if (m_content_length >= BUFFER_SIZE - m_checked_idx) {
+            return PAYLOAD_TOO_LARGE;
+        }
         if (m_content_length != 0) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
 
         return GET_REQUEST;
-    } else if (strncasecmp(text, "Connection:", 11) == 0) {
+    }
+
+    // handlers see every header, the ones below are also parsed for us
+    if (m_route) {
+        char *colon = strchr(text, ':');
+        if (colon) {
+            const char *value = colon + 1 + strspn(colon + 1, " \t");
+            m_request->add_header(text, colon - text, value, strlen(value));
+        }
+    }
+
+    if (strncasecmp(text, "Connection:", 11) == 0) {
         text += 11;
         text += strspn(text, " \t");
         if (strcasecmp(text, "keep-alive") == 0) {
@@ -298,11 +1161,41 @@ HTTP_CODE HTTPConn::parse_headers(char *text) {
     } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
         text += 15;
         text += strspn(text, " \t");
+        // digits only, a sign or garbage would make atol() lie about the body
+        int digits = strspn(text, "0123456789");
+        if (digits == 0 || text[digits + strspn(text + digits, " \t")] != 0) {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        if (digits > 9) {
+            return PAYLOAD_TOO_LARGE;
+        }
         m_content_length = atol(text);
     } else if (strncasecmp(text, "Host:", 5) == 0) {
         text += 5;
         text += strspn(text, " \t");
         m_host = text;
+    } else if (strncasecmp(text, "Upgrade:", 8) == 0) {
+        text += 8;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "h2c") == 0) {
+            m_upgrade_h2c = true;
+        }
+    } else if (strncasecmp(text, "Accept:", 7) == 0) {
+        text += 7;
+        m_accept_json = strstr(text, "application/json") != NULL;
+    } else if (strncasecmp(text, "Accept-Encoding:", 16) == 0) {
+        text += 16;
+        text += strspn(text, " \t");
+        m_accept = bundle_accept(text);
+    } else if (strncasecmp(text, "If-None-Match:", 14) == 0) {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    } else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
     } else {
         // ignore other headers
         // printf("oop! unknow header %s\n", text);
@@ -314,6 +1207,10 @@ HTTP_CODE HTTPConn::parse_headers(char *text) {
 HTTP_CODE HTTPConn::parse_content(char *text) {
     if (m_read_idx >= (m_content_length + m_checked_idx)) {
         text[m_content_length] = 0;
+        if (m_route) {
+            m_request->body.data = text;
+            m_request->body.len = m_content_length;
+        }
         return GET_REQUEST;
     }
 
@@ -328,7 +1225,7 @@ void HTTPConn::show_request(const char *text) {
     strcpy(ts, ctime(&t));
     strtok(ts, "\n"); // remove newline
 
-    printf("%s:%d - - [%s] \"%s\"\n", inet_ntoa(m_address.sin_addr), ntohs(m_address.sin_port), ts, text);
+    printf("%s - - [%s] \"%s\"\n", m_peer, ts, text);
 }
 
 HTTP_CODE HTTPConn::process_read() {
@@ -350,12 +1247,13 @@ HTTP_CODE HTTPConn::process_read() {
             if (ret == BAD_REQUEST) {
                 return BAD_REQUEST;
             }
+            m_header_start = m_start_line;
             break;
         }
         case CHECK_STATE_HEADER: {
             ret = parse_headers(text);
-            if (ret == BAD_REQUEST) {
-                return BAD_REQUEST;
+            if (ret == BAD_REQUEST || ret == PAYLOAD_TOO_LARGE) {
+                return ret;
             } else if (ret == GET_REQUEST) {
                 return do_request();
             }
@@ -378,69 +1276,195 @@ HTTP_CODE HTTPConn::process_read() {
 }
 
 HTTP_CODE HTTPConn::do_request() {
-    int len = strlen(doc_root);
+    mark(STAGE_PARSED);
+    TRACE_PROBE(parsed, m_sock_fd, m_url);
+    if (m_traced) {
+        strncpy(m_span->url, m_url, TRACE_URL_LEN - 1);
+    }
 
-    strcpy(m_real_file, doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    if (m_route) {
+        return run_handler();
+    }
+    // an upstream takes any method, the body goes along
+    m_proxy_route = proxy->match(m_url);
+    if (m_proxy_route) {
+        return PROXY_REQUEST;
+    }
+    if (m_route_denied) {
+        return METHOD_NOT_ALLOWED;
+    }
+    if (m_method != GET) {
+        return BAD_REQUEST;
+    }
 
-    if (stat(m_real_file, &m_file_stat) < 0) {
-        return NO_RESOURCE;
+    // the Host picks the site, a name we do not serve gets the default one
+    m_site = vhosts->find(m_host);
+    BundleStore *store = m_site ? &m_site->bundles : bundles;
+    int root = m_site ? m_site->root_fd : root_fd;
+
+    if (store->enabled()) {
+        HTTP_CODE ret = map_bundle(store, dirs, m_url, m_accept, m_if_none_match, &m_bundle_file);
+        if (m_bundle_file.bundle) {
+            m_file_address = (char *)m_bundle_file.address;
+            m_file_stat.st_size = m_bundle_file.size;
+            m_content_type = m_bundle_file.type;
+        }
+        record_hit(m_url, ret, m_site);
+        return ret;
     }
 
-    if (!(m_file_stat.st_mode & S_IROTH)) {
-        return FORBIDDEN_REQUEST;
+    // an h2c upgrade hands the mapping over to stream 1
+    m_readahead.sendfile = raw_send() && !(m_upgrade_h2c && m_h2_settings);
+    HTTP_CODE ret =
+        map_file(root, m_url, dirs, m_accept_json, &m_file_stat, &m_file_address, &m_content_type, &m_listing,
+                 &m_readahead);
+    if (m_listing && m_if_none_match && bundle_etag_match(m_if_none_match, m_listing->etag())) {
+        ret = NOT_MODIFIED;
     }
+    record_hit(m_url, ret, m_site);
+    return ret;
+}
 
-    if (S_ISDIR(m_file_stat.st_mode)) {
-        return BAD_REQUEST;
+HTTP_CODE HTTPConn::run_handler() {
+    if (!m_response) {
+        m_response = new Response;
     }
+    m_response->reset();
+    m_route->handler(*m_request, *m_response, m_route->arg);
+    if (m_response->m_failed) {
+        m_response->cancel();
+        return INTERNAL_ERROR;
+    }
+    return HANDLER_REQUEST;
+}
 
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    return FILE_REQUEST;
+// only paths that were served, so the manifest never warms a 404
+// the manifest warms doc_root, paths of the other sites stay out of it
+void HTTPConn::record_hit(const char *url, HTTP_CODE ret, const Site *site) {
+    if (recorder->enabled() && !site && (ret == FILE_REQUEST || ret == NOT_MODIFIED)) {
+        recorder->hit(url);
+    }
 }
 
 void HTTPConn::unmap() {
-    if (m_file_address) {
-        munmap(m_file_address, m_file_stat.st_size);
+    if (m_bundle_file.bundle) {
+        m_bundle_file.bundle->unref();
+        m_bundle_file.bundle = NULL;
+        m_file_address = 0;
+    } else if (m_listing) {
+        m_listing->unref();
+        m_listing = NULL;
         m_file_address = 0;
+    } else {
+        if (m_file_address) {
+            munmap(m_file_address, m_file_stat.st_size);
+            m_file_address = 0;
+        }
+        m_readahead.stop();
     }
 }
 
 bool HTTPConn::write() {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if (bytes_to_send == 0) {
-        mod_fd(m_epoll_fd, m_sock_fd, EPOLLIN);
+    if (m_proxy_route) {
+        return proxy->relay(this);
+    }
+
+    ssize_t temp = 0;
+    if (m_write_idx == 0) {
         init();
+        arm(EPOLLIN);
         return true;
     }
 
+    // out of tokens, the scheduler re-arms us on a later tick
+    long budget = scheduler->grant(&m_write_state);
+    if (budget == 0) {
+        scheduler->park(this, &m_write_state);
+        return true;
+    }
+    if (m_traced && !m_span->ts[STAGE_WRITING]) {
+        mark(STAGE_WRITING);
+    }
+
     while (1) {
-        temp = writev(m_sock_fd, m_iv, m_iv_count);
+        if (budget <= 0) {
+            // quantum spent, the other ready connections go first
+            scheduler->yield();
+            arm(EPOLLOUT);
+            return true;
+        }
+
+        if (m_sendfile && m_iv[0].iov_len == 0) {
+            // the body goes from the bundle or large file fd without a copy through user space
+            size_t count = ((long)m_iv[1].iov_len < budget) ? m_iv[1].iov_len : budget;
+            off_t offset = m_file_stat.st_size - m_iv[1].iov_len;
+            if (m_bundle_file.bundle) {
+                temp = sendfile(m_sock_fd, m_bundle_file.bundle->fd(), &m_bundle_file.offset, count);
+            } else {
+                temp = sendfile(m_sock_fd, m_readahead.fd(), &offset, count);
+            }
+            if (temp == 0) {
+                unmap();
+                return false;
+            }
+        } else {
+            struct iovec iv[2];
+            temp = send_iov(iv, clamp_iov(m_iv, m_sendfile ? 1 : m_iv_count, send_budget(budget), iv));
+        }
         if (temp <= -1) {
             if (errno == EAGAIN) {
-                mod_fd(m_epoll_fd, m_sock_fd, EPOLLOUT);
+                TRACE_PROBE(write_blocked, m_sock_fd, m_iv[0].iov_len + m_iv[1].iov_len);
+                if (m_traced) {
+                    m_span->stalls++;
+                }
+                scheduler->finish(&m_write_state);
+                arm(EPOLLOUT);
                 return true;
             }
             unmap();
             return false;
         }
+        scheduler->charge(&m_write_state, temp);
+        budget -= temp;
+        TRACE_PROBE(write, m_sock_fd, temp);
+        if (m_traced) {
+            m_span->bytes += temp;
+        }
+
+        // keep what is left in the iovecs for the next EPOLLOUT
+        for (int i = 0; i < m_iv_count; i++) {
+            size_t n = ((size_t)temp < m_iv[i].iov_len) ? temp : m_iv[i].iov_len;
+            m_iv[i].iov_base = (char *)m_iv[i].iov_base + n;
+            m_iv[i].iov_len -= n;
+            temp -= n;
+        }
+        if (m_readahead.active()) {
+            m_readahead.advance(m_file_stat.st_size - m_iv[1].iov_len, m_file_address);
+        }
+
+        if (m_iv[m_iv_count - 1].iov_len == 0) {
+            // a streamed body refills the second iovec chunk by chunk
+            if (m_route && m_response->m_producer) {
+                if (m_route->mode != HANDLER_INLINE) {
+                    m_stream_pending = true;
+                    return true;
+                }
+                if (!next_chunk()) {
+                    return false;
+                }
+                continue;
+            }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= 0) {
+            scheduler->finish(&m_write_state);
+            end_span();
             unmap();
             if (m_linger) {
                 init();
-                mod_fd(m_epoll_fd, m_sock_fd, EPOLLIN);
+                m_idle = true;
+                arm(EPOLLIN);
                 return true;
-            } else {
-                mod_fd(m_epoll_fd, m_sock_fd, EPOLLIN);
-                return false;
             }
+            return false;
         }
     }
 }
@@ -464,8 +1488,9 @@ bool HTTPConn::add_status_line(int status, const char *title) {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool HTTPConn::add_headers(int content_len) {
+bool HTTPConn::add_headers(int content_len, const char *type) {
     add_content_length(content_len);
+    add_content_type(type);
     add_linger();
     add_blank_line();
     return true;
@@ -475,7 +1500,37 @@ bool HTTPConn::add_content_length(int content_len) {
     return add_response("Content-Length: %d\r\n", content_len);
 }
 
+bool HTTPConn::add_content_type(const char *type) {
+    return add_response("Content-Type: %s\r\n", type);
+}
+
+// validators and the chosen variant of a bundle entry
+bool HTTPConn::add_bundle_headers() {
+    if (!m_bundle_file.bundle) {
+        return true;
+    }
+    if (!add_response("ETag: %s\r\nLast-Modified: %s\r\n", m_bundle_file.etag, m_bundle_file.last_modified)) {
+        return false;
+    }
+    if (m_bundle_file.encoding && !add_response("Content-Encoding: %s\r\n", m_bundle_file.encoding)) {
+        return false;
+    }
+    return !m_bundle_file.vary || add_response("Vary: Accept-Encoding\r\n");
+}
+
+bool HTTPConn::add_site_headers() {
+    return !m_site || m_site->head.empty() || add_response("%s", m_site->head.c_str());
+}
+
+// the same directory is HTML or JSON depending on Accept
+bool HTTPConn::add_listing_headers() {
+    return !m_listing || add_response("ETag: %s\r\nVary: Accept\r\n", m_listing->etag());
+}
+
 bool HTTPConn::add_linger() {
+    if (m_draining) {
+        m_linger = false;
+    }
     return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
@@ -487,11 +1542,128 @@ bool HTTPConn::add_content(const char *content) {
     return add_response("%s", content);
 }
 
+// forwards the request headers except the hop-by-hop ones
+// built apart from m_write_buf, a long target or cookie does not fit there
+void HTTPConn::add_proxy_request() {
+    char ip[INET6_ADDRSTRLEN];
+    format_address(&m_address, ip, sizeof(ip), false);
+
+    std::string &req = m_proxy_req;
+    req.assign(method_name(m_method));
+    req += ' ';
+    req += m_target;
+    req += " HTTP/1.1\r\n";
+
+    char *end = m_read_buf + m_header_end;
+    for (char *line = m_read_buf + m_header_start; line < end; line += strlen(line) + 2) {
+        if (strncasecmp(line, "Connection:", 11) == 0 || strncasecmp(line, "Keep-Alive:", 11) == 0) {
+            continue;
+        }
+        req += line;
+        req += "\r\n";
+    }
+
+    // a unix socket peer has no address to forward
+    if (m_address.ss_family != AF_UNIX) {
+        req += "X-Forwarded-For: ";
+        req += ip;
+        req += "\r\n";
+    }
+    req += "Connection: keep-alive\r\n\r\n";
+
+    // parse_content() waited for the whole body, it follows the blank line
+    if (m_content_length > 0) {
+        req.append(m_read_buf + m_header_end + 2, m_content_length);
+    }
+}
+
+bool HTTPConn::add_handler_response() {
+    Response *response = m_response;
+    if (!add_status_line(response->m_status, response->m_reason) ||
+        !add_response("%.*s", response->m_head_len, response->m_head) ||
+        (!response->m_has_type && !add_content_type("text/plain"))) {
+        return false;
+    }
+
+    bool body = (m_method != HEAD);
+    if (response->m_producer) {
+        if (!body) {
+            response->cancel();
+        }
+        if (!add_response("Transfer-Encoding: chunked\r\n")) {
+            return false;
+        }
+    } else if (!add_content_length(response->m_body_len)) {
+        return false;
+    }
+    if (!add_linger() || !add_blank_line()) {
+        return false;
+    }
+
+    m_iv[0].iov_base = m_write_buf;
+    m_iv[0].iov_len = m_write_idx;
+    m_iv[1].iov_base = response->m_body;
+    m_iv[1].iov_len = (body && !response->m_producer) ? response->m_body_len : 0;
+    m_iv_count = 2;
+    return true;
+}
+
+// the chunk size goes in front of the data inside the body buffer
+bool HTTPConn::next_chunk() {
+    Response *response = m_response;
+    char *data = response->m_body + CHUNK_HEAD_LEN;
+    int n = response->m_producer(data, RESPONSE_BODY_SIZE - CHUNK_HEAD_LEN - CHUNK_TAIL_LEN, response->m_state);
+    if (n <= 0) {
+        response->m_producer = NULL;
+        if (n < 0) {
+            return false;
+        }
+        memcpy(data, "0\r\n\r\n", 5);
+        m_iv[1].iov_base = data;
+        m_iv[1].iov_len = 5;
+        return true;
+    }
+
+    char head[CHUNK_HEAD_LEN + 1];
+    int len = snprintf(head, sizeof(head), "%x\r\n", n);
+    memcpy(data - len, head, len);
+    memcpy(data + n, "\r\n", CHUNK_TAIL_LEN);
+    m_iv[1].iov_base = data - len;
+    m_iv[1].iov_len = len + n + CHUNK_TAIL_LEN;
+    return true;
+}
+
+bool HTTPConn::runs_inline() const {
+    if (m_h2 || m_handshaking || m_start_line != 0 || !router->enabled()) {
+        return false;
+    }
+    // whole requests only, a partial one goes to a worker as before
+    const char *end = (const char *)memmem(m_read_buf, m_read_idx, "\r\n\r\n", 4);
+    if (!end) {
+        return false;
+    }
+
+    // the raw line is matched here, a path that is not canonical yet goes to a worker to be resolved
+    const char *path = (const char *)memchr(m_read_buf, ' ', end - m_read_buf);
+    const char *stop = path ? (const char *)memchr(path + 1, ' ', end - path - 1) : NULL;
+    char raw[BUFFER_SIZE];
+    char canonical[BUFFER_SIZE];
+    if (!stop || stop - path - 1 >= (int)sizeof(raw)) {
+        return false;
+    }
+    memcpy(raw, path + 1, stop - path - 1);
+    raw[stop - path - 1] = 0;
+    if (!canonical_url(raw, canonical, sizeof(canonical)) || strcmp(raw, canonical) != 0) {
+        return false;
+    }
+    return router->runs_inline(m_read_buf, end - m_read_buf);
+}
+
 bool HTTPConn::process_write(HTTP_CODE ret) {
     switch (ret) {
     case INTERNAL_ERROR: {
         add_status_line(500, ERROR_500_TITLE);
-        add_headers(strlen(ERROR_500_form));
+        add_headers(strlen(ERROR_500_form), "text/plain");
         if (!add_content(ERROR_500_form)) {
             return false;
         }
@@ -499,7 +1671,7 @@ bool HTTPConn::process_write(HTTP_CODE ret) {
     }
     case BAD_REQUEST: {
         add_status_line(400, ERROR_400_TITLE);
-        add_headers(strlen(ERROR_400_form));
+        add_headers(strlen(ERROR_400_form), "text/plain");
         if (!add_content(ERROR_400_form)) {
             return false;
         }
@@ -507,24 +1679,81 @@ bool HTTPConn::process_write(HTTP_CODE ret) {
     }
     case NO_RESOURCE: {
         add_status_line(404, ERROR_404_TITLE);
-        add_headers(strlen(ERROR_404_form));
+        add_headers(strlen(ERROR_404_form), "text/plain");
         if (!add_content(ERROR_404_form)) {
             return false;
         }
         break;
     }
+    case METHOD_NOT_ALLOWED: {
+        add_status_line(405, ERROR_405_TITLE);
+        add_headers(strlen(ERROR_405_form), "text/plain");
+        if (!add_content(ERROR_405_form)) {
+            return false;
+        }
+        break;
+    }
+    case PAYLOAD_TOO_LARGE: {
+        // the unread body would be taken for the next request
+        m_linger = false;
+        add_status_line(413, ERROR_413_TITLE);
+        add_headers(strlen(ERROR_413_form), "text/plain");
+        if (!add_content(ERROR_413_form)) {
+            return false;
+        }
+        break;
+    }
+    case HANDLER_REQUEST: {
+        return add_handler_response();
+    }
+    case BAD_GATEWAY: {
+        add_status_line(502, ERROR_502_TITLE);
+        add_headers(strlen(ERROR_502_form), "text/plain");
+        if (!add_content(ERROR_502_form)) {
+            return false;
+        }
+        break;
+    }
+    case PROXY_REQUEST: {
+        add_proxy_request();
+        return true;
+    }
     case FORBIDDEN_REQUEST: {
         add_status_line(403, ERROR_403_TITLE);
-        add_headers(strlen(ERROR_403_form));
+        add_headers(strlen(ERROR_403_form), "text/plain");
         if (!add_content(ERROR_403_form)) {
             return false;
         }
         break;
     }
+    case MOVED_PERMANENTLY: {
+        int len = strcspn(m_url, "?#");
+        add_status_line(301, MOVED_301_TITLE);
+        if (!add_response("Location: %.*s/%s\r\n", len, m_url, m_url + len)) {
+            return false;
+        }
+        add_headers(0, "text/plain");
+        break;
+    }
+    case NOT_MODIFIED: {
+        add_status_line(304, NOT_MODIFIED_304_TITLE);
+        add_bundle_headers();
+        add_listing_headers();
+        add_site_headers();
+        add_linger();
+        if (!add_blank_line()) {
+            return false;
+        }
+        break;
+    }
     case FILE_REQUEST: {
         add_status_line(200, OK_200_TITLE);
+        add_site_headers();
         if (m_file_stat.st_size != 0) {
-            add_headers(m_file_stat.st_size);
+            add_bundle_headers();
+            add_listing_headers();
+            add_headers(m_file_stat.st_size, m_content_type);
+            m_sendfile = (m_bundle_file.bundle || m_readahead.active()) && raw_send();
             m_iv[0].iov_base = m_write_buf;
             m_iv[0].iov_len = m_write_idx;
             m_iv[1].iov_base = m_file_address;
@@ -533,9 +1762,10 @@ bool HTTPConn::process_write(HTTP_CODE ret) {
             return true;
         }
         const char *OK_string = "it's Empty!";
-        add_headers(strlen(OK_string));
+        add_headers(strlen(OK_string), "text/plain");
         if (!add_content(OK_string))
             return false;
+        break;
     }
     default:
         return false;
@@ -547,17 +1777,204 @@ bool HTTPConn::process_write(HTTP_CODE ret) {
     return true;
 }
 
+bool HTTPConn::flush() {
+    if (m_draining) {
+        m_h2->shutdown();
+    }
+    return m_h2->flush();
+}
+
+ssize_t HTTPConn::recv_some(char *buf, size_t len) {
+    if (m_ssl) {
+        return tls_recv(m_ssl, buf, len);
+    }
+    return recv(m_sock_fd, buf, len, 0);
+}
+
+ssize_t HTTPConn::send_iov(const struct iovec *iov, int count) {
+    if (raw_send()) {
+        return writev(m_sock_fd, iov, count);
+    }
+    return tls_writev(m_ssl, iov, count, &m_tls_retry);
+}
+
+void HTTPConn::rearm(bool from_reactor) {
+    // records already decrypted by OpenSSL raise no EPOLLIN, EPOLLOUT brings us back
+    bool out = (m_h2->wants_write() && !m_write_state.parked) || tls_pending();
+    if (from_reactor) {
+        m_idle = !out && m_h2->idle();
+    }
+    arm(out ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+// decides per request whether it is timed, the span stays for the next one
+void HTTPConn::begin_span() {
+    uint64_t id;
+    m_traced = timeline->enabled() && timeline->sample(&id);
+    if (!m_traced) {
+        return;
+    }
+    if (!m_span) {
+        m_span = new TraceSpan;
+    }
+    memset(m_span, 0, sizeof(*m_span));
+    m_span->id = id;
+    m_span->fd = m_sock_fd;
+    mark(STAGE_READ);
+}
+
+void HTTPConn::end_span() {
+    TRACE_PROBE(done, m_sock_fd, m_traced ? m_span->bytes : 0);
+    if (m_traced) {
+        mark(STAGE_DONE);
+        timeline->commit(*m_span);
+        m_traced = false;
+    }
+}
+
+void HTTPConn::close_idle() {
+    if (!m_h2) {
+        close_conn();
+        return;
+    }
+    // the GOAWAY goes out on EPOLLOUT, flush() then closes
+    m_idle = false;
+    m_h2->shutdown();
+    arm(EPOLLIN | EPOLLOUT);
+}
+
+// parked HTTP/1 stays the reactor's, parked HTTP/2 waits in epoll for input;
+// anything else was taken by a worker or closed since and is left alone
+void HTTPConn::resume() {
+    int owner = OWNER_REACTOR;
+    if (!m_owner.compare_exchange_strong(owner, OWNER_REACTOR, std::memory_order_acquire) && !claim()) {
+        return;
+    }
+    m_write_state.parked = false;
+    arm(m_h2 ? (EPOLLIN | EPOLLOUT) : EPOLLOUT);
+}
+
+// a worker must not be re-armed by the tick, its rearm asks for output again
+// and the next flush parks the connection if the buckets are still empty
+void HTTPConn::to_worker() {
+    scheduler->forget(this, &m_write_state);
+    m_owner.store(OWNER_WORKER, std::memory_order_release);
+}
+
+// the owner is published before the event can fire, whichever thread picks it up
+void HTTPConn::arm(int ev) {
+    m_owner.store(OWNER_EPOLL, std::memory_order_release);
+    mod_fd(m_epoll_fd, m_sock_fd, ev, m_generation);
+}
+
+// answers the request on stream 1 and carries on as HTTP/2
+void HTTPConn::upgrade(HTTP_CODE ret) {
+    char *address = (ret == FILE_REQUEST) ? m_file_address : NULL;
+    m_file_address = NULL;
+    m_readahead.stop();
+
+    // a bundle entry moves over to stream 1 with its reference
+    BundleFile file = m_bundle_file;
+    m_bundle_file.bundle = NULL;
+    if (file.bundle) {
+        address = NULL;
+    }
+
+    m_h2 = new HTTP2Session(this);
+    if (!m_h2->upgrade(m_h2_settings, ret, address, m_file_stat.st_size, m_content_type, file.bundle ? &file : NULL) ||
+        !m_h2->feed(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx)) {
+        close_conn();
+        return;
+    }
+
+    process();
+}
+
 void HTTPConn::process() {
+    if (m_handshaking) {
+        bool want_write = false;
+        int ret = tls_handshake(m_ssl, want_write);
+        if (ret < 0) {
+            close_conn();
+            return;
+        }
+        if (ret == 0) {
+            arm(want_write ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+
+        m_handshaking = false;
+        m_ktls_send = tls_ktls_send(m_ssl);
+
+        // the request often arrives right behind the client Finished
+        if (!read()) {
+            close_conn();
+            return;
+        }
+    }
+
+    if (m_stream_pending) {
+        m_stream_pending = false;
+        if (!next_chunk()) {
+            close_conn();
+            return;
+        }
+        arm(EPOLLOUT);
+        return;
+    }
+
+    if (m_h2) {
+        if (m_draining) {
+            m_h2->shutdown();
+        }
+        if (!m_h2->process()) {
+            close_conn();
+            return;
+        }
+        rearm();
+        return;
+    }
+
+    // HTTP/2 with prior knowledge opens with the connection preface
+    int n = (m_read_idx < H2_PREFACE_LEN) ? m_read_idx : H2_PREFACE_LEN;
+    if (m_start_line == 0 && n > 0 && memcmp(m_read_buf, H2_PREFACE, n) == 0) {
+        if (n < H2_PREFACE_LEN) {
+            arm(EPOLLIN);
+            return;
+        }
+
+        m_h2 = new HTTP2Session(this);
+        m_h2->start();
+        m_h2->feed(m_read_buf, m_read_idx);
+        process();
+        return;
+    }
+
+    mark(STAGE_PICKED);
+    TRACE_PROBE(picked, m_sock_fd, m_read_idx);
     HTTP_CODE read_ret = process_read();
     if (read_ret == NO_REQUEST) {
-        mod_fd(m_epoll_fd, m_sock_fd, EPOLLIN);
+        arm(EPOLLIN);
+        return;
+    }
+    mark(STAGE_RESOLVED);
+    TRACE_PROBE(resolved, m_sock_fd, read_ret);
+    if (m_traced) {
+        m_span->code = read_ret;
+    }
+
+    // handler responses, redirects and listings are built for HTTP/1.1, the upgrade is declined
+    if (m_upgrade_h2c && m_h2_settings && read_ret != PROXY_REQUEST && read_ret != HANDLER_REQUEST &&
+        read_ret != MOVED_PERMANENTLY && !m_listing) {
+        upgrade(read_ret);
         return;
     }
 
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
         close_conn();
+        return;
     }
 
-    mod_fd(m_epoll_fd, m_sock_fd, EPOLLOUT);
+    arm(EPOLLOUT);
 }
@@ -0,0 +1,1038 @@
+#include "http2.h"
+
+static unsigned int get_u32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void frame_head(unsigned char *h, int len, int type, int flags, int stream_id) {
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put_u32(h + 5, stream_id & 0x7fffffff);
+}
+
+// the HTTP2-Settings header is base64url without padding
+static int base64url_decode(const char *in, unsigned char *out, int max) {
+    int len = 0, bits = 0;
+    unsigned int acc = 0;
+
+    for (; *in && *in != '='; in++) {
+        int v;
+        char c = *in;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '-' || c == '+') {
+            v = 62;
+        } else if (c == '_' || c == '/') {
+            v = 63;
+        } else {
+            return -1;
+        }
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len >= max) {
+                return -1;
+            }
+            out[len++] = (acc >> bits) & 0xff;
+        }
+    }
+    return len;
+}
+
+/*
+    class H2Stream
+*/
+
+H2Stream::H2Stream() {
+    m_file_address = NULL;
+    m_bundle = NULL;
+    m_listing = NULL;
+    release();
+}
+
+H2Stream::~H2Stream() {
+    release();
+}
+
+void H2Stream::release() {
+    if (m_file_address) {
+        munmap(m_file_address, m_file_size);
+        m_file_address = NULL;
+    }
+    m_readahead.stop();
+    if (m_bundle) {
+        m_bundle->unref();
+        m_bundle = NULL;
+    }
+    if (m_listing) {
+        m_listing->unref();
+        m_listing = NULL;
+    }
+    m_file_size = 0;
+
+    m_id = 0;
+    m_window = 0;
+    m_done = false;
+    m_cancelled = false;
+
+    m_body = NULL;
+    m_body_len = 0;
+    m_body_sent = 0;
+    m_owned.clear();
+    m_location.clear();
+    m_site = NULL;
+}
+
+/*
+    class HTTP2Session
+
+    Frames are parsed by a worker in process(), which answers complete
+    requests right away: the HEADERS frame goes into the control output and
+    the stream keeps a pointer into the mapped file. The reactor drains it
+    all in flush(), one batch at a time, handing each stream with body left
+    one DATA frame per round so a large file cannot hold back the small
+    ones. DATA payloads point straight into the mapping like on HTTP/1.1,
+    streams are only released once no batch references them anymore.
+*/
+
+HTTP2Session::HTTP2Session(HTTPConn *conn) {
+    m_conn = conn;
+
+    m_in_len = 0;
+    m_preface = false;
+
+    m_out_len = 0;
+    m_out_batched = 0;
+
+    m_iov_count = 0;
+    m_iov_idx = 0;
+    m_rr = 0;
+
+    m_stream_count = 0;
+    m_last_stream_id = 0;
+
+    m_continuation_id = 0;
+    m_continuation_flags = 0;
+
+    m_send_window = H2_DEFAULT_WINDOW;
+    m_peer_window = H2_DEFAULT_WINDOW;
+    m_peer_max_frame = H2_MAX_FRAME_SIZE;
+
+    m_closing = false;
+    m_draining = false;
+    m_failed = false;
+    m_response = NULL;
+}
+
+HTTP2Session::~HTTP2Session() {
+    delete m_response;
+}
+
+void HTTP2Session::start() {
+    unsigned char settings[6];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(settings + 2, H2_MAX_STREAMS);
+    queue(H2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+bool HTTP2Session::feed(const char *data, int len) {
+    if (m_in_len + len > H2_INPUT_SIZE) {
+        return false;
+    }
+    memcpy(m_in + m_in_len, data, len);
+    m_in_len += len;
+    return true;
+}
+
+bool HTTP2Session::read() {
+    // a full buffer is drained by the worker, the rearm reports the rest
+    while (m_in_len < H2_INPUT_SIZE) {
+        int n = m_conn->recv_some(m_in + m_in_len, H2_INPUT_SIZE - m_in_len);
+        if (n == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        } else if (n == 0) {
+            return false;
+        }
+        m_in_len += n;
+    }
+    return true;
+}
+
+// the request that asked for h2c becomes stream 1, half closed already
+bool HTTP2Session::upgrade(const char *settings, HTTP_CODE ret, char *address, off_t size, const char *type, const BundleFile *file) {
+    const char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Upgrade: h2c\r\n\r\n";
+    queue_raw(switching, strlen(switching));
+    start();
+
+    unsigned char payload[0x100];
+    int len = base64url_decode(settings, payload, sizeof(payload));
+    if (len < 0 || (len % 6) || !apply_settings(payload, len)) {
+        if (address) {
+            munmap(address, size);
+        }
+        if (file) {
+            file->bundle->unref();
+        }
+        return false;
+    }
+
+    m_last_stream_id = 1;
+    H2Stream *stream = open(1);
+    stream->m_site = m_conn->m_site;
+    respond(stream, ret, address, size, type, file);
+    return !m_failed;
+}
+
+bool HTTP2Session::process() {
+    int pos = 0;
+    if (!m_preface) {
+        int n = (m_in_len < H2_PREFACE_LEN) ? m_in_len : H2_PREFACE_LEN;
+        if (memcmp(m_in, H2_PREFACE, n) != 0) {
+            return false;
+        }
+        if (n < H2_PREFACE_LEN) {
+            return true;
+        }
+        m_preface = true;
+        pos = H2_PREFACE_LEN;
+    }
+
+    while (!m_closing && m_in_len - pos >= H2_FRAME_HEADER_LEN) {
+        const unsigned char *h = (const unsigned char *)m_in + pos;
+        int len = (h[0] << 16) | (h[1] << 8) | h[2];
+        if (len > H2_MAX_FRAME_SIZE) {
+            goaway(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_in_len - pos - H2_FRAME_HEADER_LEN < len) {
+            break;
+        }
+
+        on_frame(h[3], h[4], get_u32(h + 5) & 0x7fffffff, h + H2_FRAME_HEADER_LEN, len);
+        pos += H2_FRAME_HEADER_LEN + len;
+    }
+
+    if (m_closing) {
+        m_in_len = 0;
+    } else {
+        memmove(m_in, m_in + pos, m_in_len - pos);
+        m_in_len -= pos;
+    }
+
+    if (m_iov_count == 0) {
+        sweep();
+    }
+    return !m_failed && !finished();
+}
+
+bool HTTP2Session::flush() {
+    WriteScheduler *scheduler = m_conn->scheduler;
+    WriteState *state = &m_conn->m_write_state;
+    long budget = scheduler->grant(state);
+    if (budget == 0) {
+        if (wants_write()) {
+            scheduler->park(m_conn, state);
+        }
+        return true;
+    }
+
+    struct iovec iv[1 + H2_BATCH_FRAMES * 2];
+    while (true) {
+        if (m_iov_count == 0) {
+            build_batch();
+            if (m_iov_count == 0) {
+                break;
+            }
+        }
+
+        // rearm() asks for EPOLLOUT again, the other connections go first
+        if (budget <= 0) {
+            scheduler->yield();
+            return true;
+        }
+
+        long turn = m_conn->send_budget(budget);
+        ssize_t n = m_conn->send_iov(iv, clamp_iov(m_iov + m_iov_idx, m_iov_count - m_iov_idx, turn, iv));
+        if (n < 0) {
+            scheduler->finish(state);
+            return errno == EAGAIN;
+        }
+        scheduler->charge(state, n);
+        budget -= n;
+
+        while (n > 0 && m_iov_idx < m_iov_count) {
+            struct iovec *iv = m_iov + m_iov_idx;
+            if ((size_t)n >= iv->iov_len) {
+                n -= iv->iov_len;
+                m_iov_idx++;
+            } else {
+                iv->iov_base = (char *)iv->iov_base + n;
+                iv->iov_len -= n;
+                n = 0;
+            }
+        }
+
+        if (m_iov_idx == m_iov_count) {
+            finish_batch();
+        }
+    }
+
+    scheduler->finish(state);
+    return !finished();
+}
+
+bool HTTP2Session::wants_write() const {
+    return m_iov_count > 0 || m_out_len > 0 || sendable();
+}
+
+bool HTTP2Session::idle() const {
+    return m_stream_count == 0 && !wants_write();
+}
+
+bool HTTP2Session::finished() const {
+    if (m_iov_count > 0 || m_out_len > 0) {
+        return false;
+    }
+    return m_closing || (m_draining && m_stream_count == 0);
+}
+
+bool HTTP2Session::sendable() const {
+    if (m_closing || m_send_window <= 0) {
+        return false;
+    }
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        const H2Stream *stream = m_streams + i;
+        if (stream->m_id && !stream->m_done && !stream->m_cancelled && stream->m_window > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HTTP2Session::on_frame(int type, int flags, int stream_id, const unsigned char *payload, int len) {
+    if (m_continuation_id && (type != H2_CONTINUATION || stream_id != m_continuation_id)) {
+        return goaway(H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case H2_DATA: {
+        if (stream_id == 0 || stream_id > m_last_stream_id) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (len > 0) {
+            // request bodies are not used, hand the window straight back
+            unsigned char increment[4];
+            put_u32(increment, len);
+            queue(H2_WINDOW_UPDATE, 0, 0, increment, 4);
+            if (find(stream_id) && !(flags & H2_FLAG_END_STREAM)) {
+                queue(H2_WINDOW_UPDATE, 0, stream_id, increment, 4);
+            }
+        }
+        return true;
+    }
+    case H2_HEADERS: {
+        if (stream_id == 0 || !(stream_id & 1)) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+
+        int pad = 0, offset = 0;
+        if (flags & H2_FLAG_PADDED) {
+            if (len < 1) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            pad = payload[0];
+            offset = 1;
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            offset += 5;
+        }
+        if (offset + pad > len) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+
+        m_header_block.assign((const char *)payload + offset, len - offset - pad);
+        m_continuation_flags = flags;
+        if (!(flags & H2_FLAG_END_HEADERS)) {
+            m_continuation_id = stream_id;
+            return true;
+        }
+        return on_headers(stream_id);
+    }
+    case H2_CONTINUATION: {
+        if (!m_continuation_id) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (m_header_block.size() + len > H2_INPUT_SIZE) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+
+        m_header_block.append((const char *)payload, len);
+        if (flags & H2_FLAG_END_HEADERS) {
+            int id = m_continuation_id;
+            m_continuation_id = 0;
+            return on_headers(id);
+        }
+        return true;
+    }
+    case H2_PRIORITY: {
+        if (stream_id == 0) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (len != 5) {
+            reset_stream(stream_id, H2_FRAME_SIZE_ERROR);
+        }
+        return true;
+    }
+    case H2_RST_STREAM: {
+        if (stream_id == 0 || stream_id > m_last_stream_id) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (len != 4) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+        H2Stream *stream = find(stream_id);
+        if (stream) {
+            stream->m_cancelled = true;
+        }
+        return true;
+    }
+    case H2_SETTINGS: {
+        if (stream_id != 0) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (flags & H2_FLAG_ACK) {
+            return len == 0 || goaway(H2_FRAME_SIZE_ERROR);
+        }
+        if (len % 6) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+        if (!apply_settings(payload, len)) {
+            return false;
+        }
+        return queue(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    }
+    case H2_PING: {
+        if (stream_id != 0) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        if (len != 8) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+        if (!(flags & H2_FLAG_ACK)) {
+            return queue(H2_PING, H2_FLAG_ACK, 0, payload, 8);
+        }
+        return true;
+    }
+    case H2_GOAWAY: {
+        if (stream_id != 0) {
+            return goaway(H2_PROTOCOL_ERROR);
+        }
+        // finish the streams in flight, then close
+        m_draining = true;
+        return true;
+    }
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) {
+            return goaway(H2_FRAME_SIZE_ERROR);
+        }
+
+        long increment = get_u32(payload) & 0x7fffffff;
+        if (stream_id == 0) {
+            if (increment == 0) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            m_send_window += increment;
+            if (m_send_window > H2_MAX_WINDOW) {
+                return goaway(H2_FLOW_CONTROL_ERROR);
+            }
+            return true;
+        }
+
+        H2Stream *stream = find(stream_id);
+        if (increment == 0) {
+            reset_stream(stream_id, H2_PROTOCOL_ERROR);
+            if (stream) {
+                stream->m_cancelled = true;
+            }
+            return true;
+        }
+        if (stream) {
+            stream->m_window += increment;
+            if (stream->m_window > H2_MAX_WINDOW) {
+                reset_stream(stream_id, H2_FLOW_CONTROL_ERROR);
+                stream->m_cancelled = true;
+            }
+        }
+        return true;
+    }
+    case H2_PUSH_PROMISE:
+        // clients never push
+        return goaway(H2_PROTOCOL_ERROR);
+    default:
+        // unknown frame types are ignored
+        return true;
+    }
+}
+
+bool HTTP2Session::on_headers(int stream_id) {
+    std::vector<HeaderField> headers;
+
+    // the block must be decoded even when the stream is refused to keep the table in sync
+    if (!m_decoder.decode((const unsigned char *)m_header_block.data(), m_header_block.size(), headers)) {
+        return goaway(H2_COMPRESSION_ERROR);
+    }
+
+    if (stream_id <= m_last_stream_id) {
+        // trailers of a request that was answered already
+        if (!find(stream_id)) {
+            reset_stream(stream_id, H2_STREAM_CLOSED);
+        }
+        return true;
+    }
+    m_last_stream_id = stream_id;
+
+    if (m_draining) {
+        return true;
+    }
+    if (m_stream_count >= H2_MAX_STREAMS) {
+        reset_stream(stream_id, H2_REFUSED_STREAM);
+        return true;
+    }
+
+    on_request(open(stream_id), headers);
+    return true;
+}
+
+bool HTTP2Session::apply_settings(const unsigned char *payload, int len) {
+    for (int i = 0; i + 6 <= len; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        unsigned int value = get_u32(payload + i + 2);
+
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            m_encoder.resize(value);
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > H2_MAX_WINDOW) {
+                return goaway(H2_FLOW_CONTROL_ERROR);
+            }
+            // applies to the open streams too
+            long delta = (long)value - m_peer_window;
+            m_peer_window = value;
+            for (int s = 0; s < H2_MAX_STREAMS; s++) {
+                if (m_streams[s].m_id) {
+                    m_streams[s].m_window += delta;
+                }
+            }
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME_SIZE || value > H2_MAX_FRAME_LIMIT) {
+                return goaway(H2_PROTOCOL_ERROR);
+            }
+            m_peer_max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+// the directory with its slash, the query kept
+static std::string with_slash(const char *path) {
+    int len = strcspn(path, "?#");
+    return std::string(path, len) + "/" + (path + len);
+}
+
+void HTTP2Session::on_request(H2Stream *stream, const std::vector<HeaderField> &headers) {
+    TRACE_PROBE(h2_request, m_conn->m_sock_fd, stream->m_id);
+    const char *method = NULL;
+    const char *path = NULL;
+    const char *if_none_match = NULL;
+    const char *authority = NULL;
+    int accept = 0;
+    bool json = false;
+
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (headers[i].first == ":method") {
+            method = headers[i].second.c_str();
+        } else if (headers[i].first == ":path") {
+            path = headers[i].second.c_str();
+        } else if (headers[i].first == ":authority" || (headers[i].first == "host" && !authority)) {
+            authority = headers[i].second.c_str();
+        } else if (headers[i].first == "accept-encoding") {
+            accept = bundle_accept(headers[i].second.c_str());
+        } else if (headers[i].first == "accept") {
+            json = headers[i].second.find("application/json") != std::string::npos;
+        } else if (headers[i].first == "if-none-match") {
+            if_none_match = headers[i].second.c_str();
+        }
+    }
+
+    char line[FILENAME_LEN + 0x20];
+    snprintf(line, sizeof(line), "%s %s HTTP/2", method ? method : "-", path ? path : "-");
+    m_conn->show_request(line);
+
+    int method_id = method ? method_of(method, strlen(method)) : -1;
+    if (method_id < 0 || !path || path[0] != '/') {
+        respond(stream, BAD_REQUEST, NULL, 0, NULL, NULL);
+        return;
+    }
+
+    // the same canonical path as HTTP/1.1 for routes, proxy, sites and files
+    char url[BUFFER_SIZE];
+    if (!canonical_url(path, url, sizeof(url))) {
+        respond(stream, BAD_REQUEST, NULL, 0, NULL, NULL);
+        return;
+    }
+    path = url;
+
+    if (m_conn->router->enabled()) {
+        RequestView request;
+        int len = strcspn(path, "?#");
+        bool allowed;
+        const Route *route = m_conn->router->match((METHOD)method_id, path, len, &request, &allowed);
+        if (route) {
+            request.method = (METHOD)method_id;
+            request.path.data = path;
+            request.path.len = len;
+            request.query.data = path + len + (path[len] == '?');
+            request.query.len = (path[len] == '?') ? strcspn(path + len + 1, "#") : 0;
+            run_handler(stream, route, request, headers);
+            return;
+        }
+        if (!allowed) {
+            respond(stream, METHOD_NOT_ALLOWED, NULL, 0, NULL, NULL);
+            return;
+        }
+    }
+
+    if (method_id != GET) {
+        respond(stream, BAD_REQUEST, NULL, 0, NULL, NULL);
+        return;
+    }
+
+    // proxy routes are relayed over HTTP/1.1 only
+    if (m_conn->proxy->match(path)) {
+        respond(stream, BAD_GATEWAY, NULL, 0, NULL, NULL);
+        return;
+    }
+
+    Site *site = m_conn->vhosts->find(authority);
+    BundleStore *store = site ? &site->bundles : m_conn->bundles;
+    stream->m_site = site;
+
+    if (store->enabled()) {
+        BundleFile file;
+        file.bundle = NULL;
+        HTTP_CODE ret = map_bundle(store, m_conn->dirs, path, accept, if_none_match, &file);
+        if (ret == MOVED_PERMANENTLY) {
+            stream->m_location = with_slash(path);
+        }
+        m_conn->record_hit(path, ret, site);
+        respond(stream, ret, NULL, 0, NULL, file.bundle ? &file : NULL);
+        return;
+    }
+
+    struct stat st;
+    char *address = NULL;
+    const char *type = NULL;
+    Listing *listing = NULL;
+    stream->m_readahead.files = m_conn->large_files;
+    HTTP_CODE ret = map_file(site ? site->root_fd : m_conn->root_fd, path, m_conn->dirs, json, &st, &address, &type,
+                             &listing, &stream->m_readahead);
+    if (listing && if_none_match && bundle_etag_match(if_none_match, listing->etag())) {
+        ret = NOT_MODIFIED;
+    } else if (ret == MOVED_PERMANENTLY) {
+        stream->m_location = with_slash(path);
+    }
+    m_conn->record_hit(path, ret, site);
+    stream->m_listing = listing;
+    respond(stream, ret, address, (ret == FILE_REQUEST) ? st.st_size : 0, type, NULL);
+}
+
+// a bundle file hands its reference over to the stream
+void HTTP2Session::respond(H2Stream *stream, HTTP_CODE ret, char *address, off_t size, const char *type, const BundleFile *file) {
+    int status = 200;
+    const char *form = NULL;
+
+    switch (ret) {
+    case FILE_REQUEST:
+        break;
+    case NOT_MODIFIED:
+        status = 304;
+        break;
+    case MOVED_PERMANENTLY:
+        status = 301;
+        type = "text/plain";
+        break;
+    case BAD_REQUEST:
+        status = 400;
+        form = ERROR_400_form;
+        break;
+    case FORBIDDEN_REQUEST:
+        status = 403;
+        form = ERROR_403_form;
+        break;
+    case NO_RESOURCE:
+        status = 404;
+        form = ERROR_404_form;
+        break;
+    case METHOD_NOT_ALLOWED:
+        status = 405;
+        form = ERROR_405_form;
+        break;
+    case PAYLOAD_TOO_LARGE:
+        status = 413;
+        form = ERROR_413_form;
+        break;
+    case BAD_GATEWAY:
+        status = 502;
+        form = ERROR_502_form;
+        break;
+    default:
+        status = 500;
+        form = ERROR_500_form;
+        break;
+    }
+
+    if (file) {
+        stream->m_bundle = file->bundle;
+        address = (char *)file->address;
+        size = (ret == FILE_REQUEST) ? file->size : 0;
+        type = file->type;
+    } else if (!stream->m_listing) {
+        stream->m_file_address = address;
+        stream->m_file_size = size;
+    }
+
+    if (form) {
+        stream->m_body = form;
+        stream->m_body_len = strlen(form);
+    } else {
+        stream->m_body = address;
+        stream->m_body_len = size;
+    }
+
+    char value[0x20];
+    std::string block;
+    snprintf(value, sizeof(value), "%d", status);
+    m_encoder.encode(":status", value, false, block);
+    if (status != 304) {
+        snprintf(value, sizeof(value), "%ld", stream->m_body_len);
+        m_encoder.encode("content-length", value, false, block);
+        // few distinct types per connection, worth a dynamic table entry
+        m_encoder.encode("content-type", form ? "text/plain" : type, true, block);
+    }
+    if (file) {
+        m_encoder.encode("etag", file->etag, false, block);
+        m_encoder.encode("last-modified", file->last_modified, false, block);
+        if (file->encoding && status != 304) {
+            m_encoder.encode("content-encoding", file->encoding, true, block);
+        }
+        if (file->vary) {
+            m_encoder.encode("vary", "accept-encoding", true, block);
+        }
+    }
+    if (stream->m_listing) {
+        m_encoder.encode("etag", stream->m_listing->etag(), false, block);
+        m_encoder.encode("vary", "accept", true, block);
+    }
+    if (!stream->m_location.empty()) {
+        m_encoder.encode("location", stream->m_location.c_str(), false, block);
+    }
+    if (stream->m_site && (ret == FILE_REQUEST || ret == NOT_MODIFIED)) {
+        const Site *site = stream->m_site;
+        for (size_t i = 0; i < site->headers.size(); i++) {
+            m_encoder.encode(site->headers[i].first.c_str(), site->headers[i].second.c_str(), true, block);
+        }
+    }
+
+    queue_headers(stream, block);
+}
+
+// runs on the worker whatever the handler mode, a streamed body is collected
+// first since DATA frames need no chunking
+void HTTP2Session::run_handler(H2Stream *stream, const Route *route, RequestView &request, const std::vector<HeaderField> &headers) {
+    request.body.data = "";
+    request.body.len = 0;
+    request.header_count = 0;
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HeaderField &h = headers[i];
+        if (h.first[0] != ':') {
+            request.add_header(h.first.data(), h.first.size(), h.second.data(), h.second.size());
+        }
+    }
+
+    if (!m_response) {
+        m_response = new Response;
+    }
+    Response *response = m_response;
+    response->reset();
+    route->handler(request, *response, route->arg);
+    if (response->m_failed) {
+        response->cancel();
+        respond(stream, INTERNAL_ERROR, NULL, 0, NULL, NULL);
+        return;
+    }
+
+    stream->m_owned.assign(response->m_body, response->m_body_len);
+    if (request.method == HEAD) {
+        response->cancel();
+    }
+    while (response->m_producer) {
+        int n = response->m_producer(response->m_body, RESPONSE_BODY_SIZE, response->m_state);
+        if (n < 0) {
+            response->m_producer = NULL;
+            respond(stream, INTERNAL_ERROR, NULL, 0, NULL, NULL);
+            return;
+        }
+        if (n == 0) {
+            response->m_producer = NULL;
+        }
+        stream->m_owned.append(response->m_body, n);
+    }
+
+    char value[0x20];
+    std::string block;
+    snprintf(value, sizeof(value), "%d", response->m_status);
+    m_encoder.encode(":status", value, false, block);
+
+    // "Name: value" lines, names lowercased and hop-by-hop ones dropped
+    const char *line = response->m_head;
+    const char *end = response->m_head + response->m_head_len;
+    while (line < end) {
+        const char *eol = (const char *)memchr(line, '\r', end - line);
+        const char *colon = (const char *)memchr(line, ':', eol - line);
+        if (colon) {
+            std::string name(line, colon - line);
+            for (size_t i = 0; i < name.size(); i++) {
+                name[i] = tolower(name[i]);
+            }
+            std::string field(colon + 1 + strspn(colon + 1, " \t"), eol);
+            if (name != "connection" && name != "keep-alive" && name != "transfer-encoding") {
+                m_encoder.encode(name.c_str(), field.c_str(), false, block);
+            }
+        }
+        line = eol + 2;
+    }
+    if (!response->m_has_type) {
+        m_encoder.encode("content-type", "text/plain", true, block);
+    }
+    snprintf(value, sizeof(value), "%zu", stream->m_owned.size());
+    m_encoder.encode("content-length", value, false, block);
+
+    stream->m_body = stream->m_owned.data();
+    stream->m_body_len = (request.method == HEAD) ? 0 : stream->m_owned.size();
+    queue_headers(stream, block);
+}
+
+void HTTP2Session::queue_headers(H2Stream *stream, const std::string &block) {
+    int flags = (stream->m_body_len == 0) ? H2_FLAG_END_STREAM : 0;
+    if (stream->m_body_len == 0) {
+        stream->m_done = true;
+    }
+
+    // split over CONTINUATION frames when larger than the peer takes
+    int frame_type = H2_HEADERS;
+    int offset = 0, total = block.size();
+    do {
+        int n = total - offset;
+        if (n > m_peer_max_frame) {
+            n = m_peer_max_frame;
+        }
+        int frame_flags = (offset + n == total) ? H2_FLAG_END_HEADERS : 0;
+        if (frame_type == H2_HEADERS) {
+            frame_flags |= flags;
+        }
+        queue(frame_type, frame_flags, stream->m_id, block.data() + offset, n);
+        offset += n;
+        frame_type = H2_CONTINUATION;
+    } while (offset < total);
+}
+
+H2Stream *HTTP2Session::find(int stream_id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (m_streams[i].m_id == stream_id) {
+            return m_streams + i;
+        }
+    }
+    return NULL;
+}
+
+H2Stream *HTTP2Session::open(int stream_id) {
+    H2Stream *stream = find(0);
+    stream->m_id = stream_id;
+    stream->m_window = m_peer_window;
+    m_stream_count++;
+    return stream;
+}
+
+bool HTTP2Session::queue(int type, int flags, int stream_id, const void *payload, int len) {
+    if (m_out_len + H2_FRAME_HEADER_LEN + len > H2_OUTPUT_SIZE) {
+        m_failed = true;
+        return false;
+    }
+
+    frame_head((unsigned char *)m_out + m_out_len, len, type, flags, stream_id);
+    m_out_len += H2_FRAME_HEADER_LEN;
+    if (len > 0) {
+        memcpy(m_out + m_out_len, payload, len);
+        m_out_len += len;
+    }
+    return true;
+}
+
+bool HTTP2Session::queue_raw(const char *data, int len) {
+    if (m_out_len + len > H2_OUTPUT_SIZE) {
+        m_failed = true;
+        return false;
+    }
+    memcpy(m_out + m_out_len, data, len);
+    m_out_len += len;
+    return true;
+}
+
+void HTTP2Session::reset_stream(int stream_id, H2_ERROR error) {
+    unsigned char code[4];
+    put_u32(code, error);
+    queue(H2_RST_STREAM, 0, stream_id, code, 4);
+}
+
+bool HTTP2Session::goaway(H2_ERROR error) {
+    unsigned char payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, error);
+    queue(H2_GOAWAY, 0, 0, payload, 8);
+    m_closing = true;
+    return false;
+}
+
+void HTTP2Session::shutdown() {
+    if (m_closing || m_draining) {
+        return;
+    }
+    unsigned char payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, H2_NO_ERROR);
+    queue(H2_GOAWAY, 0, 0, payload, 8);
+    m_draining = true;
+}
+
+void HTTP2Session::build_batch() {
+    m_iov_count = 0;
+    m_iov_idx = 0;
+
+    if (m_out_len > 0) {
+        m_iov[0].iov_base = m_out;
+        m_iov[0].iov_len = m_out_len;
+        m_out_batched = m_out_len;
+        m_iov_count = 1;
+    }
+
+    if (m_closing) {
+        return;
+    }
+
+    // the previous batch went out whole, what it carried can leave the page cache
+    for (int k = 0; k < H2_MAX_STREAMS; k++) {
+        H2Stream *stream = m_streams + k;
+        if (stream->m_id && stream->m_readahead.active()) {
+            stream->m_readahead.advance(stream->m_body_sent, stream->m_file_address);
+        }
+    }
+
+    // one frame per stream and round until the batch or a window is full
+    int frames = 0;
+    bool progress = true;
+    while (progress && frames < H2_BATCH_FRAMES && m_send_window > 0) {
+        progress = false;
+        for (int k = 0; k < H2_MAX_STREAMS && frames < H2_BATCH_FRAMES && m_send_window > 0; k++) {
+            H2Stream *stream = m_streams + (m_rr + k) % H2_MAX_STREAMS;
+            if (!stream->m_id || stream->m_done || stream->m_cancelled) {
+                continue;
+            }
+
+            long n = stream->m_body_len - stream->m_body_sent;
+            if (n > m_peer_max_frame) {
+                n = m_peer_max_frame;
+            }
+            if (n > m_send_window) {
+                n = m_send_window;
+            }
+            if (n > stream->m_window) {
+                n = stream->m_window;
+            }
+            if (n <= 0) {
+                continue;
+            }
+
+            bool last = (stream->m_body_sent + n == stream->m_body_len);
+            unsigned char *head = m_frame_heads[frames++];
+            frame_head(head, n, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->m_id);
+
+            m_iov[m_iov_count].iov_base = head;
+            m_iov[m_iov_count].iov_len = H2_FRAME_HEADER_LEN;
+            m_iov_count++;
+            m_iov[m_iov_count].iov_base = (char *)stream->m_body + stream->m_body_sent;
+            m_iov[m_iov_count].iov_len = n;
+            m_iov_count++;
+
+            stream->m_body_sent += n;
+            stream->m_window -= n;
+            m_send_window -= n;
+            if (last) {
+                stream->m_done = true;
+            }
+            progress = true;
+        }
+    }
+
+    m_rr = (m_rr + 1) % H2_MAX_STREAMS;
+}
+
+void HTTP2Session::finish_batch() {
+    // keep the control frames queued while the batch was in flight
+    memmove(m_out, m_out + m_out_batched, m_out_len - m_out_batched);
+    m_out_len -= m_out_batched;
+    m_out_batched = 0;
+
+    m_iov_count = 0;
+    m_iov_idx = 0;
+    sweep();
+}
+
+void HTTP2Session::sweep() {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        H2Stream *stream = m_streams + i;
+        if (stream->m_id && (stream->m_done || stream->m_cancelled)) {
+            stream->release();
+            m_stream_count--;
+        }
+    }
+}
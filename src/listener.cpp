@@ -0,0 +1,332 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+bool parse_address(const char *spec, struct sockaddr_storage *addr, socklen_t *len, bool passive) {
+    memset(addr, 0, sizeof(*addr));
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        const char *path = spec + 5;
+        size_t path_len = strlen(path);
+        if (path_len == 0 || path_len >= sizeof(un->sun_path)) {
+            return false;
+        }
+
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, path_len);
+        if (path[0] == '@') {
+            // abstract namespace, not NUL terminated
+            un->sun_path[0] = 0;
+            *len = offsetof(struct sockaddr_un, sun_path) + path_len;
+        } else {
+            *len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+        }
+        return true;
+    }
+
+    char host[LISTENER_NAME_LEN];
+    strncpy(host, spec, LISTENER_NAME_LEN - 1);
+    host[LISTENER_NAME_LEN - 1] = 0;
+
+    char *port = strrchr(host, ':');
+    if (!port) {
+        return false;
+    }
+    *port++ = 0;
+
+    char *name = host;
+    if (name[0] == '[') {
+        char *end = strchr(++name, ']');
+        if (!end) {
+            return false;
+        }
+        *end = 0;
+    }
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive && (name[0] == 0 || strcmp(name, "*") == 0)) {
+        hints.ai_family = AF_INET;
+        hints.ai_flags = AI_PASSIVE;
+        name = NULL;
+    }
+    if (getaddrinfo(name, port, &hints, &res) != 0) {
+        return false;
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+void format_address(const struct sockaddr_storage *addr, char *buf, int size, bool port) {
+    char ip[INET6_ADDRSTRLEN];
+    int number = 0;
+    bool v6 = false;
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        number = ntohs(in->sin_port);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        // IPv4 clients of a dual-stack listener
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            inet_ntop(AF_INET, in6->sin6_addr.s6_addr + 12, ip, sizeof(ip));
+        } else {
+            inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+            v6 = true;
+        }
+        number = ntohs(in6->sin6_port);
+    } else {
+        snprintf(buf, size, "unix");
+        return;
+    }
+
+    if (!port) {
+        snprintf(buf, size, "%s", ip);
+    } else if (v6) {
+        snprintf(buf, size, "[%s]:%d", ip, number);
+    } else {
+        snprintf(buf, size, "%s:%d", ip, number);
+    }
+}
+
+/*
+    class Listener
+*/
+
+Listener::Listener() {
+    memset(m_name, 0, sizeof(m_name));
+    memset(&m_addr, 0, sizeof(m_addr));
+    m_addr_len = 0;
+    m_fd = -1;
+
+    m_backlog = LISTEN_BACKLOG;
+    m_v6only = -1;
+    m_reuseport = -1;
+    m_nodelay = -1;
+    m_defer_accept = -1;
+    m_fastopen = -1;
+    m_rcvbuf = -1;
+    m_sndbuf = -1;
+    m_mode = -1;
+}
+
+Listener::~Listener() {
+    close();
+}
+
+// "[::]:8080,v6only=0,backlog=1024" or "unix:/run/xhttpd.sock,mode=0660"
+bool Listener::parse(const char *spec) {
+    char buf[LISTENER_NAME_LEN];
+    strncpy(buf, spec, LISTENER_NAME_LEN - 1);
+    buf[LISTENER_NAME_LEN - 1] = 0;
+
+    char *save = NULL;
+    char *item = strtok_r(buf, ",", &save);
+    if (!item || !parse_address(item, &m_addr, &m_addr_len, true)) {
+        return false;
+    }
+    strcpy(m_name, item);
+
+    while ((item = strtok_r(NULL, ",", &save))) {
+        char *value = strchr(item, '=');
+        if (value) {
+            *value++ = 0;
+        }
+        // a bare flag turns the option on
+        int number = value ? strtol(value, NULL, 0) : 1;
+
+        if (strcmp(item, "backlog") == 0) {
+            m_backlog = number;
+        } else if (strcmp(item, "v6only") == 0) {
+            m_v6only = number;
+        } else if (strcmp(item, "reuseport") == 0) {
+            m_reuseport = number;
+        } else if (strcmp(item, "nodelay") == 0) {
+            m_nodelay = number;
+        } else if (strcmp(item, "defer_accept") == 0) {
+            m_defer_accept = number;
+        } else if (strcmp(item, "fastopen") == 0) {
+            m_fastopen = number;
+        } else if (strcmp(item, "rcvbuf") == 0) {
+            m_rcvbuf = number;
+        } else if (strcmp(item, "sndbuf") == 0) {
+            m_sndbuf = number;
+        } else if (strcmp(item, "mode") == 0 && value) {
+            m_mode = strtol(value, NULL, 8);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool set_option(int fd, int level, int name, int value) {
+    return value < 0 || setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+}
+
+bool Listener::open() {
+    int family = m_addr.ss_family;
+    struct sockaddr_un *un = (struct sockaddr_un *)&m_addr;
+    bool path = (family == AF_UNIX && un->sun_path[0] != 0);
+
+    m_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        printf("error: cannot listen at %s: %s\n", m_name, strerror(errno));
+        return false;
+    }
+
+    bool ok = set_option(m_fd, SOL_SOCKET, SO_REUSEPORT, m_reuseport) &&
+              set_option(m_fd, SOL_SOCKET, SO_RCVBUF, m_rcvbuf) &&
+              set_option(m_fd, SOL_SOCKET, SO_SNDBUF, m_sndbuf);
+
+    if (family != AF_UNIX) {
+        // "[::]" takes IPv4 clients too unless v6only is asked for
+        ok = ok && set_option(m_fd, SOL_SOCKET, SO_REUSEADDR, 1) &&
+             (family != AF_INET6 || set_option(m_fd, IPPROTO_IPV6, IPV6_V6ONLY, (m_v6only < 0) ? 0 : m_v6only)) &&
+             set_option(m_fd, IPPROTO_TCP, TCP_NODELAY, m_nodelay) &&
+             set_option(m_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, m_defer_accept) &&
+             set_option(m_fd, IPPROTO_TCP, TCP_FASTOPEN, m_fastopen);
+    } else if (path) {
+        // a socket file nobody answers on is left over from a crash
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&m_addr, m_addr_len) < 0 && errno == ECONNREFUSED) {
+            unlink(un->sun_path);
+        }
+        if (probe >= 0) {
+            ::close(probe);
+        }
+    }
+
+    ok = ok && bind(m_fd, (struct sockaddr *)&m_addr, m_addr_len) == 0 &&
+         (!path || m_mode < 0 || chmod(un->sun_path, m_mode) == 0) &&
+         listen(m_fd, m_backlog) == 0;
+    if (!ok) {
+        printf("error: cannot listen at %s: %s\n", m_name, strerror(errno));
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    printf("*) listen at %s\n", m_name);
+    return true;
+}
+
+void Listener::adopt(int fd) {
+    m_fd = fd;
+    printf("*) listen at %s (inherited)\n", m_name);
+}
+
+void Listener::close() {
+    if (m_fd < 0) {
+        return;
+    }
+    release();
+
+    struct sockaddr_un *un = (struct sockaddr_un *)&m_addr;
+    if (m_addr.ss_family == AF_UNIX && un->sun_path[0] != 0) {
+        unlink(un->sun_path);
+    }
+}
+
+void Listener::release() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// names are "\n" separated in the payload, in the order of the fds
+bool send_listeners(int sock, const std::vector<Listener *> &listeners) {
+    char names[MAX_LISTENERS * LISTENER_NAME_LEN];
+    int fds[MAX_LISTENERS];
+    int count = 0;
+    int len = 0;
+    for (size_t i = 0; i < listeners.size() && count < MAX_LISTENERS; i++) {
+        if (listeners[i]->m_fd < 0) {
+            continue;
+        }
+        len += sprintf(names + len, "%s\n", listeners[i]->m_name);
+        fds[count++] = listeners[i]->m_fd;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {names, (size_t)len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    return count > 0 && sendmsg(sock, &msg, 0) == len;
+}
+
+int receive_listeners(int sock, const std::vector<Listener *> &listeners) {
+    char names[MAX_LISTENERS * LISTENER_NAME_LEN + 1];
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct iovec iov = {names, sizeof(names) - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (len <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        return 0;
+    }
+    names[len] = 0;
+
+    int fds[MAX_LISTENERS];
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+    // a listener dropped from the command line is closed, a new one opens itself
+    int adopted = 0;
+    char *save = NULL;
+    char *name = strtok_r(names, "\n", &save);
+    for (int i = 0; i < count; i++, name = name ? strtok_r(NULL, "\n", &save) : NULL) {
+        Listener *owner = NULL;
+        for (size_t j = 0; name && j < listeners.size(); j++) {
+            if (listeners[j]->m_fd < 0 && strcmp(listeners[j]->m_name, name) == 0) {
+                owner = listeners[j];
+                break;
+            }
+        }
+        if (owner) {
+            owner->adopt(fds[i]);
+            adopted++;
+        } else {
+            ::close(fds[i]);
+        }
+    }
+    return adopted;
+}
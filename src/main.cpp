@@ -2,6 +2,7 @@
 #include <cassert>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,8 +10,10 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
 
 #include "http.h"
+#include "threadpool.h"
 
 void addsig(int sig, void(handler)(int), bool restart = true) {
     struct sigaction sa;
@@ -23,35 +26,343 @@ void addsig(int sig, void(handler)(int), bool restart = true) {
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+static void handle_reload(int sig) {
+    HTTPServer::reload_pending = 1;
+}
+
+static void handle_shutdown(int sig) {
+    HTTPServer::shutdown_pending = 1;
+}
+
+static void handle_upgrade(int sig) {
+    HTTPServer::upgrade_pending = 1;
+}
+
+// answered on the reactor, a load balancer probe never waits for a worker
+static void health(const RequestView &request, Response &response, void *arg) {
+    const WriteScheduler *writes = (const WriteScheduler *)arg;
+    response.header("Cache-Control", "no-store");
+    response.print("ok %d\n", HTTPConn::m_conn_count.load());
+    response.print("yields %lu\nstalls %lu\n", writes->yields(), writes->stalls());
+}
+
+// bytes with an optional k, m or g suffix, -1 when malformed
+static long parse_size(const char *text) {
+    char *end;
+    long size = strtol(text, &end, 10);
+    if (end == text || size < 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        size <<= 10, end++;
+        break;
+    case 'm':
+    case 'M':
+        size <<= 20, end++;
+        break;
+    case 'g':
+    case 'G':
+        size <<= 30, end++;
+        break;
+    }
+    return *end ? -1 : size;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [options] host port <dir>\n", name);
+    printf("       %s [options] -l address [-l address...] <dir>\n", name);
+    printf("  -l, --listen address[,option...]\n");
+    printf("        host:port, [v6]:port, *:port, unix:/path or unix:@abstract, options are\n");
+    printf("        backlog=n, v6only, reuseport, nodelay, defer_accept=s, fastopen=n,\n");
+    printf("        rcvbuf=n, sndbuf=n and mode=0660 for a unix socket file\n");
+    printf("  -H, --health path     answer path with \"ok\" and the connection count\n");
+    printf("  -P, --proxy prefix=upstream[,upstream...]\n");
+    printf("        forward requests under prefix, upstream is host:port or unix:path\n");
+    printf("  -V, --vhost name[,name...]=dir[;Header: value...]\n");
+    printf("        serve Host name (or *.suffix) from dir or bundle:file, with extra headers\n");
+    printf("  -i, --index names     index files of a directory, comma separated (default index.html)\n");
+    printf("  -a, --autoindex       list directories without an index file, JSON for Accept:\n");
+    printf("        application/json\n");
+    printf("  -m, --mime-types file mime.types to override the builtin extension table\n");
+    printf("  -b, --bundle file     serve from a bundle packed by xbundle, SIGHUP reloads it\n");
+    printf("  -c, --cert file.pem   serve HTTPS with this certificate chain\n");
+    printf("  -k, --key file.pem    private key of the certificate\n");
+    printf("  -w, --warm file       warm the paths listed in file before accepting\n");
+    printf("  -f, --warm-fraction f accept once this fraction of them is warm (default 1.0)\n");
+    printf("  -r, --record file     write the hottest paths to file for the next --warm\n");
+    printf("  -q, --quantum bytes   bytes a connection writes before yielding (default 256k)\n");
+    printf("  -R, --conn-rate bytes cap every connection at bytes per second, k/m/g suffixes\n");
+    printf("  -G, --global-rate bytes\n");
+    printf("        cap all responses together at bytes per second\n");
+    printf("  -L, --large-file bytes\n");
+    printf("        stream files of at least bytes with readahead, dropping sent pages (default\n");
+    printf("        64m, 0 for off)\n");
+    printf("  -K, --keep-cached n   keep a large file cached once asked for n times a minute\n");
+    printf("        (default 4, 0 for never)\n");
+    printf("  -t, --trace file      time sampled requests stage by stage, SIGHUP writes them\n");
+    printf("        to file as Chrome trace JSON\n");
+    printf("  -T, --trace-sample n  sample 1 in n requests (default 100)\n");
+    printf("  -D, --drain-timeout s seconds in flight responses get to finish (default 30)\n");
+    printf("  -n, --threads n       worker threads for parsing and handlers (default 4)\n");
+    printf("signals: HUP reloads the bundle, TERM and INT drain and exit, USR2 starts\n");
+    printf("         a new process with the same arguments and hands the listeners over\n");
+}
+
 int main(int argc, char *argv[]) {
     int ret = -1;
+    const char *name = *argv;
+    char **args = argv;
 
-    if (argc < 3) {
-        printf("usage: %s host port <dir>\n", *argv);
-        return -ret;
-    }
+    static struct option options[] = {
+        {"listen", required_argument, NULL, 'l'},
+        {"health", required_argument, NULL, 'H'},
+        {"proxy", required_argument, NULL, 'P'},
+        {"vhost", required_argument, NULL, 'V'},
+        {"index", required_argument, NULL, 'i'},
+        {"autoindex", no_argument, NULL, 'a'},
+        {"mime-types", required_argument, NULL, 'm'},
+        {"bundle", required_argument, NULL, 'b'},
+        {"cert", required_argument, NULL, 'c'},
+        {"key", required_argument, NULL, 'k'},
+        {"warm", required_argument, NULL, 'w'},
+        {"warm-fraction", required_argument, NULL, 'f'},
+        {"record", required_argument, NULL, 'r'},
+        {"quantum", required_argument, NULL, 'q'},
+        {"conn-rate", required_argument, NULL, 'R'},
+        {"global-rate", required_argument, NULL, 'G'},
+        {"large-file", required_argument, NULL, 'L'},
+        {"keep-cached", required_argument, NULL, 'K'},
+        {"drain-timeout", required_argument, NULL, 'D'},
+        {"threads", required_argument, NULL, 'n'},
+        {"trace", required_argument, NULL, 't'},
+        {"trace-sample", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}};
 
-    argc--;
-    argv++;
+    std::vector<const char *> listeners;
+    std::vector<const char *> proxies;
+    std::vector<const char *> vhosts;
+    const char *health_path = NULL;
+    const char *index = NULL;
+    bool autoindex = false;
+    const char *bundle = NULL;
+    const char *cert = NULL;
+    const char *key = NULL;
+    const char *warm = NULL;
+    double warm_fraction = 1.0;
+    const char *record = NULL;
+    long quantum = 0;
+    long conn_rate = 0;
+    long global_rate = 0;
+    long large_file = LARGE_FILE_SIZE;
+    int keep_hits = KEEP_CACHED_HITS;
+    int drain_timeout = DRAIN_TIMEOUT;
+    int threads = DEFAULT_THREAD_NUMBER;
+    const char *trace = NULL;
+    int trace_rate = TRACE_SAMPLE_RATE;
 
-    char host[0x20];
-    strcpy(host, *argv);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:H:P:V:i:am:b:c:k:w:f:r:q:R:G:L:K:D:n:t:T:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            listeners.push_back(optarg);
+            break;
+        case 'H':
+            health_path = optarg;
+            break;
+        case 'P':
+            proxies.push_back(optarg);
+            break;
+        case 'V':
+            vhosts.push_back(optarg);
+            break;
+        case 'i':
+            index = optarg;
+            break;
+        case 'a':
+            autoindex = true;
+            break;
+        case 'm':
+            if (!mime_load(optarg)) {
+                printf("error: cannot load MIME types from %s\n", optarg);
+                return -ret;
+            }
+            break;
+        case 'b':
+            bundle = optarg;
+            break;
+        case 'c':
+            cert = optarg;
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        case 'w':
+            warm = optarg;
+            break;
+        case 'f':
+            warm_fraction = atof(optarg);
+            if (warm_fraction < 0 || warm_fraction > 1) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        case 'r':
+            record = optarg;
+            break;
+        case 'q':
+        case 'R':
+        case 'G': {
+            long size = parse_size(optarg);
+            if (size < 0 || (opt == 'q' && size == 0)) {
+                usage(name);
+                return -ret;
+            }
+            if (opt == 'q') {
+                quantum = size;
+            } else if (opt == 'R') {
+                conn_rate = size;
+            } else {
+                global_rate = size;
+            }
+            break;
+        }
+        case 'L':
+            large_file = parse_size(optarg);
+            if (large_file < 0) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        case 'K':
+            keep_hits = atoi(optarg);
+            if (keep_hits < 0) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'T':
+            trace_rate = atoi(optarg);
+            if (trace_rate <= 0) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        case 'D':
+            drain_timeout = atoi(optarg);
+            if (drain_timeout < 0) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        case 'n':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                usage(name);
+                return -ret;
+            }
+            break;
+        default:
+            usage(name);
+            return -ret;
+        }
+    }
 
-    argc--;
-    argv++;
+    argc -= optind;
+    argv += optind;
 
-    int port;
-    port = atoi(*argv);
+    // without --listen the first two arguments are the host and port
+    char address[LISTENER_NAME_LEN];
+    if (listeners.empty()) {
+        if (argc < 2) {
+            usage(name);
+            return -ret;
+        }
+        const char *fmt = strchr(argv[0], ':') ? "[%s]:%s" : "%s:%s";
+        snprintf(address, sizeof(address), fmt, argv[0], argv[1]);
+        listeners.push_back(address);
 
-    argc--;
-    argv++;
+        argc -= 2;
+        argv += 2;
+    }
 
     char doc_root[FILENAME_LEN];
     (argc > 0) ? strcpy(doc_root, *argv) : strcpy(doc_root, "./");
 
     addsig(SIGPIPE, SIG_IGN);
+    addsig(SIGHUP, handle_reload);
+    addsig(SIGTERM, handle_shutdown);
+    addsig(SIGINT, handle_shutdown);
+    addsig(SIGUSR2, handle_upgrade);
+
+    HTTPServer server(doc_root);
+    server.enable_upgrade(args);
+    server.set_drain_timeout(drain_timeout);
+    server.set_threads(threads);
+    if (index && !server.set_index(index)) {
+        printf("error: bad index file list %s\n", index);
+        return -ret;
+    }
+    if (autoindex) {
+        server.enable_listings();
+    }
+
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (!server.add_listener(listeners[i])) {
+            printf("error: bad listen address %s\n", listeners[i]);
+            return -ret;
+        }
+    }
+
+    server.configure_writes(quantum, conn_rate, global_rate);
+    server.configure_large_files(large_file, keep_hits);
+
+    if (health_path && !server.route(METHOD_BIT(GET), health_path, health, server.write_scheduler(), HANDLER_INLINE)) {
+        printf("error: bad health path %s\n", health_path);
+        return -ret;
+    }
+
+    for (size_t i = 0; i < proxies.size(); i++) {
+        if (!server.add_proxy(proxies[i])) {
+            printf("error: bad proxy route %s\n", proxies[i]);
+            return -ret;
+        }
+    }
+
+    for (size_t i = 0; i < vhosts.size(); i++) {
+        if (!server.add_vhost(vhosts[i])) {
+            printf("error: bad virtual host %s\n", vhosts[i]);
+            return -ret;
+        }
+    }
 
-    HTTPServer server(host, port, doc_root);
+    if (bundle && !server.load_bundle(bundle)) {
+        return -ret;
+    }
+
+    // a missing manifest is the first run of --warm and --record on the same file
+    if (warm && !server.load_warm_manifest(warm, warm_fraction)) {
+        printf("*) no warm-up manifest at %s\n", warm);
+    }
+
+    if (record) {
+        server.record_access(record);
+    }
+
+    if (trace) {
+        server.enable_trace(trace, trace_rate);
+    }
+
+    if (cert || key) {
+        if (!cert || !key || !server.enable_tls(cert, key)) {
+            printf("error: cannot load certificate %s and key %s\n", cert ? cert : "-", key ? key : "-");
+            return -ret;
+        }
+    }
 
     return server.serve_forever();
 }
@@ -0,0 +1,285 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+static constexpr MimeType builtin_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"txt", "text/plain"},
+    {"md", "text/markdown"},
+    {"csv", "text/csv"},
+    {"xml", "text/xml"},
+    {"ics", "text/calendar"},
+    {"vcf", "text/vcard"},
+    {"yaml", "text/yaml"},
+    {"yml", "text/yaml"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tgz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"7z", "application/x-7z-compressed"},
+    {"rar", "application/vnd.rar"},
+    {"jar", "application/java-archive"},
+    {"apk", "application/vnd.android.package-archive"},
+    {"doc", "application/msword"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"epub", "application/epub+zip"},
+    {"rtf", "application/rtf"},
+    {"bin", "application/octet-stream"},
+    {"exe", "application/octet-stream"},
+    {"iso", "application/octet-stream"},
+    {"dmg", "application/octet-stream"},
+    {"deb", "application/octet-stream"},
+    {"rpm", "application/octet-stream"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp3", "audio/mpeg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"oga", "audio/ogg"},
+    {"opus", "audio/ogg"},
+    {"m4a", "audio/mp4"},
+    {"aac", "audio/aac"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"ogg", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"mkv", "video/x-matroska"},
+    {"avi", "video/x-msvideo"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"ts", "video/mp2t"},
+};
+
+static constexpr char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a over the lowercased extension
+static constexpr uint32_t mime_hash(const char *ext, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)lower(ext[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// murmur3 finalizer, each displacement gives an unrelated slot
+static constexpr int mime_slot(uint32_t h, uint32_t disp) {
+    h ^= disp * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h & (MIME_SLOTS - 1);
+}
+
+static constexpr int mime_len(const char *s) {
+    int n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+// evaluated by the compiler for the builtin types, at startup for a config
+static constexpr MimeTable mime_build(const MimeType *types, int count) {
+    MimeTable t = {};
+    uint32_t hash[MIME_MAX_TYPES] = {};
+    int bucket[MIME_MAX_TYPES] = {};
+    int size[MIME_BUCKETS] = {};
+    int owner[MIME_SLOTS] = {};
+
+    if (count > MIME_MAX_TYPES) {
+        return t;
+    }
+
+    int largest = 0;
+    for (int i = 0; i < count; i++) {
+        hash[i] = mime_hash(types[i].ext, mime_len(types[i].ext));
+        bucket[i] = hash[i] & (MIME_BUCKETS - 1);
+        if (++size[bucket[i]] > largest) {
+            largest = size[bucket[i]];
+        }
+    }
+
+    // crowded buckets go first while most slots are still free
+    for (int n = largest; n > 0; n--) {
+        for (int b = 0; b < MIME_BUCKETS; b++) {
+            if (size[b] != n) {
+                continue;
+            }
+
+            uint32_t d = 0;
+            for (; d < 0x10000; d++) {
+                bool fits = true;
+                for (int i = 0; i < count && fits; i++) {
+                    if (bucket[i] == b) {
+                        int s = mime_slot(hash[i], d);
+                        if (owner[s]) {
+                            fits = false;
+                        } else {
+                            owner[s] = i + 1;
+                        }
+                    }
+                }
+                if (fits) {
+                    break;
+                }
+                for (int i = 0; i < count; i++) {
+                    if (bucket[i] == b && owner[mime_slot(hash[i], d)] == i + 1) {
+                        owner[mime_slot(hash[i], d)] = 0;
+                    }
+                }
+            }
+            if (d == 0x10000) {
+                return t;
+            }
+            t.disp[b] = d;
+        }
+    }
+
+    for (int s = 0; s < MIME_SLOTS; s++) {
+        if (owner[s]) {
+            t.slots[s] = types[owner[s] - 1];
+        }
+    }
+    t.ok = true;
+    return t;
+}
+
+static constexpr int builtin_count = sizeof(builtin_types) / sizeof(builtin_types[0]);
+static constexpr MimeTable builtin_table = mime_build(builtin_types, builtin_count);
+static_assert(builtin_table.ok, "builtin MIME types have no perfect hash");
+
+static MimeTable loaded_table;
+static const MimeTable *table = &builtin_table;
+
+// entries from the file override the builtin ones with the same extension
+bool mime_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+
+    static MimeType types[MIME_MAX_TYPES];
+    int count = builtin_count;
+    memcpy(types, builtin_types, sizeof(builtin_types));
+
+    char line[0x400];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = 0;
+        }
+
+        char *save = NULL;
+        const char *delim = " \t\r\n;";
+        char *word = strtok_r(line, delim, &save);
+        if (!word) {
+            continue;
+        }
+        char *type = strdup(word);
+
+        while ((word = strtok_r(NULL, delim, &save)) != NULL) {
+            if (strlen(word) > MIME_EXT_LEN) {
+                continue;
+            }
+            for (char *p = word; *p; p++) {
+                *p = tolower((unsigned char)*p);
+            }
+
+            int i = 0;
+            while (i < count && strcmp(types[i].ext, word) != 0) {
+                i++;
+            }
+            if (i == MIME_MAX_TYPES) {
+                ok = false;
+                break;
+            }
+            if (i == count) {
+                types[count++].ext = strdup(word);
+            }
+            types[i].type = type;
+        }
+    }
+    fclose(fp);
+
+    if (!ok) {
+        printf("error: more than %d MIME types in %s\n", MIME_MAX_TYPES, path);
+        return false;
+    }
+
+    loaded_table = mime_build(types, count);
+    if (!loaded_table.ok) {
+        printf("error: no perfect hash for the MIME types in %s\n", path);
+        return false;
+    }
+    table = &loaded_table;
+    return true;
+}
+
+// by the extension of the last path segment, the query is not part of it
+const char *mime_type(const char *path) {
+    const char *end = path + strcspn(path, "?#");
+    const char *ext = end;
+    while (ext > path && ext[-1] != '.' && ext[-1] != '/') {
+        ext--;
+    }
+    if (ext == path || ext[-1] != '.') {
+        return MIME_DEFAULT;
+    }
+
+    int len = end - ext;
+    if (len == 0 || len > MIME_EXT_LEN) {
+        return MIME_DEFAULT;
+    }
+
+    uint32_t h = mime_hash(ext, len);
+    const MimeType &m = table->slots[mime_slot(h, table->disp[h & (MIME_BUCKETS - 1)])];
+    if (m.ext && strncasecmp(m.ext, ext, len) == 0 && m.ext[len] == 0) {
+        return m.type;
+    }
+    return MIME_DEFAULT;
+}
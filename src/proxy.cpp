@@ -0,0 +1,834 @@
+#include <ctype.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+
+#include "http.h"
+#include "listener.h"
+#include "proxy.h"
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static const char *header_value(const char *line, int name_len) {
+    line += name_len;
+    return line + strspn(line, " \t");
+}
+
+/*
+    class Upstream
+*/
+
+Upstream::Upstream() {
+    memset(m_name, 0, sizeof(m_name));
+    memset(&m_addr, 0, sizeof(m_addr));
+    m_addr_len = 0;
+
+    m_outstanding = 0;
+    m_fails = 0;
+    m_down_until = 0;
+}
+
+Upstream::~Upstream() {}
+
+bool Upstream::parse(const char *spec) {
+    strncpy(m_name, spec, PROXY_PREFIX_LEN - 1);
+    return parse_address(spec, &m_addr, &m_addr_len, false);
+}
+
+bool Upstream::available(time_t now) const {
+    return m_down_until <= now;
+}
+
+void Upstream::mark_ok() {
+    if (m_fails >= UPSTREAM_MAX_FAILS) {
+        printf("*) upstream %s is up\n", m_name);
+    }
+    m_fails = 0;
+    m_down_until = 0;
+}
+
+void Upstream::mark_failed(time_t now) {
+    // once down, a single failed probe after the timeout keeps it down
+    if (++m_fails >= UPSTREAM_MAX_FAILS) {
+        m_down_until = now + UPSTREAM_FAIL_TIMEOUT;
+        printf("*) upstream %s is down for %ds\n", m_name, UPSTREAM_FAIL_TIMEOUT);
+    }
+}
+
+int Upstream::take_idle() {
+    if (m_idle.empty()) {
+        return -1;
+    }
+
+    // most recently used first, it is the least likely to be stale
+    int fd = m_idle.back();
+    m_idle.pop_back();
+    return fd;
+}
+
+bool Upstream::put_idle(int fd) {
+    if ((int)m_idle.size() >= UPSTREAM_IDLE_CONNS) {
+        return false;
+    }
+    m_idle.push_back(fd);
+    return true;
+}
+
+void Upstream::drop_idle(int fd) {
+    for (size_t i = 0; i < m_idle.size(); i++) {
+        if (m_idle[i] == fd) {
+            m_idle.erase(m_idle.begin() + i);
+            return;
+        }
+    }
+}
+
+/*
+    class ProxyRoute
+*/
+
+ProxyRoute::ProxyRoute() {
+    memset(m_prefix, 0, sizeof(m_prefix));
+    m_prefix_len = 0;
+    m_next = 0;
+}
+
+ProxyRoute::~ProxyRoute() {
+    for (size_t i = 0; i < m_upstreams.size(); i++)
+        delete m_upstreams[i];
+}
+
+// least outstanding requests among healthy upstreams, ties rotate
+Upstream *ProxyRoute::pick(time_t now) {
+    int n = m_upstreams.size();
+    Upstream *best = NULL;
+
+    for (int i = 0; i < n; i++) {
+        Upstream *upstream = m_upstreams[(m_next + i) % n];
+        if (!upstream->available(now)) {
+            continue;
+        }
+        if (!best || upstream->m_outstanding < best->m_outstanding) {
+            best = upstream;
+        }
+    }
+
+    m_next = (m_next + 1) % n;
+    return best;
+}
+
+/*
+    class UpstreamConn
+*/
+
+UpstreamConn::UpstreamConn(int fd, Upstream *upstream) {
+    m_fd = fd;
+    m_upstream = upstream;
+    m_reused = false;
+    m_splice = true;
+    m_pipe[0] = m_pipe[1] = -1;
+    m_pipe_len = 0;
+
+    reset();
+}
+
+UpstreamConn::~UpstreamConn() {
+    if (m_pipe[0] >= 0) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+void UpstreamConn::reset() {
+    m_client = NULL;
+    m_state = UPSTREAM_IDLE;
+    m_keep_alive = false;
+
+    m_req = NULL;
+    m_req_len = 0;
+    m_req_sent = 0;
+
+    m_head_len = 0;
+    m_buf_len = 0;
+    m_buf_sent = 0;
+
+    m_body_mode = BODY_NONE;
+    m_body_left = 0;
+    m_body_done = false;
+
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_left = 0;
+}
+
+bool UpstreamConn::open_pipe() {
+    if (m_pipe[0] >= 0) {
+        return true;
+    }
+    if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        m_pipe[0] = m_pipe[1] = -1;
+        m_splice = false;
+        return false;
+    }
+    return true;
+}
+
+// returns how many bytes of data belong to the current response
+int UpstreamConn::consume(const char *data, int len) {
+    switch (m_body_mode) {
+    case BODY_LENGTH: {
+        int n = (len < m_body_left) ? len : (int)m_body_left;
+        m_body_left -= n;
+        if (m_body_left == 0) {
+            m_body_done = true;
+        }
+        return n;
+    }
+    case BODY_CHUNKED:
+        return feed_chunked(data, len);
+    case BODY_EOF:
+        return len;
+    default:
+        m_body_done = true;
+        return 0;
+    }
+}
+
+// walks the chunked framing without decoding it, the bytes are relayed as is
+int UpstreamConn::feed_chunked(const char *data, int len) {
+    int i = 0;
+    while (i < len && m_chunk_state != CHUNK_DONE) {
+        char c = data[i];
+        switch (m_chunk_state) {
+        case CHUNK_SIZE: {
+            int v = hex_value(c);
+            if (v >= 0) {
+                if (m_chunk_left > (LONG_MAX >> 4)) {
+                    return -1;
+                }
+                m_chunk_left = (m_chunk_left << 4) | v;
+            } else if (c == '\r') {
+                m_chunk_state = CHUNK_SIZE_LF;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                m_chunk_state = CHUNK_EXT;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+        }
+        case CHUNK_EXT:
+            if (c == '\r') {
+                m_chunk_state = CHUNK_SIZE_LF;
+            }
+            i++;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            m_chunk_state = (m_chunk_left == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+            i++;
+            break;
+        case CHUNK_DATA: {
+            long n = len - i;
+            if (n > m_chunk_left) {
+                n = m_chunk_left;
+            }
+            i += n;
+            m_chunk_left -= n;
+            if (m_chunk_left == 0) {
+                m_chunk_state = CHUNK_DATA_CR;
+            }
+            break;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r') {
+                return -1;
+            }
+            m_chunk_state = CHUNK_DATA_LF;
+            i++;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            m_chunk_state = CHUNK_SIZE;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            m_chunk_state = (c == '\r') ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+                m_chunk_state = CHUNK_TRAILER;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            m_chunk_state = CHUNK_DONE;
+            i++;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (m_chunk_state == CHUNK_DONE) {
+        m_body_done = true;
+    }
+    return i;
+}
+
+/*
+    class Proxy
+*/
+
+Proxy::Proxy() {
+    m_route_count = 0;
+    m_conns = new UpstreamConn *[MAX_FD]();
+}
+
+Proxy::~Proxy() {
+    for (int fd = 0; fd < MAX_FD; fd++) {
+        if (m_conns[fd]) {
+            close(fd);
+            delete m_conns[fd];
+        }
+    }
+    delete[] m_conns;
+}
+
+// spec is "/prefix=upstream[,upstream...]"
+bool Proxy::add_route(const char *spec) {
+    if (m_route_count >= MAX_PROXY_ROUTES) {
+        return false;
+    }
+
+    const char *eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || (eq - spec) >= PROXY_PREFIX_LEN) {
+        return false;
+    }
+
+    ProxyRoute *route = m_routes + m_route_count;
+    memcpy(route->m_prefix, spec, eq - spec);
+    route->m_prefix[eq - spec] = 0;
+    route->m_prefix_len = eq - spec;
+
+    char list[PROXY_PREFIX_LEN * MAX_UPSTREAMS];
+    strncpy(list, eq + 1, sizeof(list) - 1);
+    list[sizeof(list) - 1] = 0;
+
+    bool ok = true;
+    char *save = NULL;
+    for (char *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        Upstream *upstream = new Upstream;
+        if (route->m_upstreams.size() >= MAX_UPSTREAMS || !upstream->parse(item)) {
+            printf("error: bad upstream %s\n", item);
+            delete upstream;
+            ok = false;
+            break;
+        }
+        route->m_upstreams.push_back(upstream);
+    }
+
+    if (!ok || route->m_upstreams.empty()) {
+        for (size_t i = 0; i < route->m_upstreams.size(); i++)
+            delete route->m_upstreams[i];
+        route->m_upstreams.clear();
+        return false;
+    }
+
+    m_route_count++;
+    printf("*) HTTPD proxy %s to %s\n", route->m_prefix, eq + 1);
+    return true;
+}
+
+// longest prefix wins, "/api" takes "/api", "/api/x" and "/api?q" but not "/apix"
+ProxyRoute *Proxy::match(const char *url) {
+    ProxyRoute *best = NULL;
+    for (int i = 0; i < m_route_count; i++) {
+        ProxyRoute *route = m_routes + i;
+        int len = route->m_prefix_len;
+        if (strncmp(url, route->m_prefix, len) != 0) {
+            continue;
+        }
+        char next = url[len];
+        if (route->m_prefix[len - 1] != '/' && next != 0 && next != '/' && next != '?') {
+            continue;
+        }
+        if (!best || route->m_prefix_len > best->m_prefix_len) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+/*
+    The proxy runs entirely on the reactor thread. A worker only builds the
+    upstream request into the client write buffer and marks the connection
+    with its route, the client EPOLLOUT then lands in relay() which drives
+    the upstream connection from there. Every path returns whether the
+    client connection is still alive, callers close it otherwise.
+*/
+
+bool Proxy::relay(HTTPConn *conn) {
+    if (!conn->m_upstream) {
+        return start(conn, false);
+    }
+    return pump(conn->m_upstream);
+}
+
+void Proxy::handle(int fd, unsigned int events) {
+    UpstreamConn *u = m_conns[fd];
+
+    if (u->m_state == UPSTREAM_IDLE) {
+        // a pooled connection only reports the upstream closing it
+        u->m_upstream->drop_idle(fd);
+        release(u, false);
+        return;
+    }
+
+    HTTPConn *conn = u->m_client;
+    bool alive = false;
+    switch (u->m_state) {
+    case UPSTREAM_CONNECTING:
+    case UPSTREAM_SENDING:
+        alive = on_writable(u);
+        break;
+    case UPSTREAM_HEADERS:
+        alive = on_headers(u);
+        break;
+    default:
+        alive = pump(u);
+        break;
+    }
+
+    if (!alive) {
+        conn->close_conn();
+    }
+}
+
+void Proxy::detach(HTTPConn *conn) {
+    if (conn->m_upstream) {
+        release(conn->m_upstream, false);
+    }
+}
+
+bool Proxy::start(HTTPConn *conn, bool fresh) {
+    time_t now = time(NULL);
+    int tries = conn->m_proxy_route->m_upstreams.size();
+
+    UPSTREAM_STATE state = UPSTREAM_SENDING;
+    Upstream *upstream = NULL;
+    UpstreamConn *u = NULL;
+
+    // connect failures move on to the next upstream, nothing was sent yet
+    while (!u) {
+        if (conn->m_proxy_tries++ >= tries) {
+            return bad_gateway(conn);
+        }
+        upstream = conn->m_proxy_route->pick(now);
+        if (!upstream) {
+            return bad_gateway(conn);
+        }
+
+        int fd = fresh ? -1 : upstream->take_idle();
+        if (fd >= 0) {
+            u = m_conns[fd];
+            u->m_reused = true;
+            // a reused connection going stale does not count as an attempt
+            conn->m_proxy_tries--;
+        } else {
+            u = connect_upstream(upstream, state);
+            if (!u) {
+                upstream->mark_failed(now);
+                continue;
+            }
+            u->m_reused = false;
+        }
+    }
+
+    u->reset();
+    u->m_state = state;
+    u->m_client = conn;
+    u->m_req = conn->m_proxy_req.data();
+    u->m_req_len = conn->m_proxy_req.size();
+
+    upstream->m_outstanding++;
+    conn->m_upstream = u;
+
+    if (state == UPSTREAM_CONNECTING) {
+        mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLOUT);
+        return true;
+    }
+    return on_writable(u);
+}
+
+UpstreamConn *Proxy::connect_upstream(Upstream *upstream, UPSTREAM_STATE &state) {
+    int family = upstream->m_addr.ss_family;
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fd >= MAX_FD) {
+        close(fd);
+        return NULL;
+    }
+
+    if (family != AF_UNIX) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+
+    state = UPSTREAM_SENDING;
+    if (connect(fd, (struct sockaddr *)&upstream->m_addr, upstream->m_addr_len) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return NULL;
+        }
+        state = UPSTREAM_CONNECTING;
+    }
+
+    epoll_event event;
+    event.data.u64 = EVENT_TOKEN(fd, 0);
+    event.events = EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(HTTPConn::m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    UpstreamConn *u = new UpstreamConn(fd, upstream);
+    m_conns[fd] = u;
+    return u;
+}
+
+bool Proxy::on_writable(UpstreamConn *u) {
+    if (u->m_state == UPSTREAM_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(u->m_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            return fail(u);
+        }
+        u->m_state = UPSTREAM_SENDING;
+    }
+
+    while (u->m_req_sent < u->m_req_len) {
+        int n = send(u->m_fd, u->m_req + u->m_req_sent, u->m_req_len - u->m_req_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLOUT);
+                return true;
+            }
+            // a pooled connection may have been closed by the upstream meanwhile
+            return u->m_reused ? retry(u) : fail(u);
+        }
+        u->m_req_sent += n;
+    }
+
+    u->m_state = UPSTREAM_HEADERS;
+    mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLIN);
+    return true;
+}
+
+bool Proxy::on_headers(UpstreamConn *u) {
+    while (true) {
+        if (u->m_head_len >= UPSTREAM_HEAD_SIZE) {
+            return fail(u);
+        }
+
+        int n = recv(u->m_fd, u->m_head + u->m_head_len, UPSTREAM_HEAD_SIZE - u->m_head_len, 0);
+        if (n < 0 && errno == EAGAIN) {
+            mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLIN);
+            return true;
+        }
+        if (n <= 0) {
+            return (u->m_reused && u->m_head_len == 0) ? retry(u) : fail(u);
+        }
+
+        int from = (u->m_head_len > 3) ? u->m_head_len - 3 : 0;
+        u->m_head_len += n;
+
+        char *end = (char *)memmem(u->m_head + from, u->m_head_len - from, "\r\n\r\n", 4);
+        if (end) {
+            if (!parse_head(u, end - u->m_head + 4)) {
+                return fail(u);
+            }
+            return pump(u);
+        }
+    }
+}
+
+static bool append(UpstreamConn *u, const char *data, int len) {
+    if (u->m_buf_len + len > RELAY_BUFFER_SIZE) {
+        return false;
+    }
+    memcpy(u->m_buf + u->m_buf_len, data, len);
+    u->m_buf_len += len;
+    return true;
+}
+
+// rewrites the hop-by-hop headers and queues the head for the client
+bool Proxy::parse_head(UpstreamConn *u, int head_end) {
+    HTTPConn *conn = u->m_client;
+    u->m_head[head_end - 2] = 0;
+
+    char *line = u->m_head;
+    char *next = strstr(line, "\r\n");
+    *next = 0;
+    next += 2;
+
+    if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12 || line[8] != ' ' || !isdigit(line[9]) ||
+        !isdigit(line[10]) || !isdigit(line[11]) || (line[12] != 0 && line[12] != ' ')) {
+        return false;
+    }
+    int status = atoi(line + 9);
+    u->m_keep_alive = (line[7] == '1');
+
+    bool chunked = false;
+    long length = -1;
+
+    // the client talks HTTP/1.1 to us whatever version the upstream speaks
+    const char *reason = line + 12 + strspn(line + 12, " ");
+    char status_line[0x80];
+    int n = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %.*s\r\n", status, 64, reason);
+    u->m_buf_len = 0;
+    u->m_buf_sent = 0;
+    append(u, status_line, n);
+
+    for (line = next; *line; line = next) {
+        next = strstr(line, "\r\n");
+        if (!next) {
+            return false;
+        }
+        *next = 0;
+        next += 2;
+
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = header_value(line, 11);
+            if (strcasestr(value, "close")) {
+                u->m_keep_alive = false;
+            } else if (strcasestr(value, "keep-alive")) {
+                u->m_keep_alive = true;
+            }
+            continue;
+        } else if (strncasecmp(line, "Keep-Alive:", 11) == 0) {
+            continue;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = strcasestr(header_value(line, 18), "chunked") != NULL;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            length = atol(header_value(line, 15));
+            if (length < 0) {
+                return false;
+            }
+        }
+
+        append(u, line, strlen(line));
+        append(u, "\r\n", 2);
+    }
+
+    // the answer to HEAD carries the length of a body it does not send
+    if ((status >= 100 && status < 200) || status == 204 || status == 304 || conn->m_method == HEAD) {
+        u->m_body_mode = BODY_NONE;
+    } else if (chunked) {
+        u->m_body_mode = BODY_CHUNKED;
+    } else if (length > 0) {
+        u->m_body_mode = BODY_LENGTH;
+        u->m_body_left = length;
+    } else if (length == 0) {
+        u->m_body_mode = BODY_NONE;
+    } else {
+        // delimited by the upstream closing, the client has to follow suit
+        u->m_body_mode = BODY_EOF;
+        u->m_keep_alive = false;
+        conn->m_linger = false;
+    }
+
+    if (HTTPConn::m_draining) {
+        conn->m_linger = false;
+    }
+    const char *linger = conn->m_linger ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    append(u, linger, strlen(linger));
+
+    if (u->m_body_mode == BODY_NONE) {
+        u->m_body_done = true;
+    }
+
+    int rest = u->m_head_len - head_end;
+    if (rest > 0) {
+        int used = u->consume(u->m_head + head_end, rest);
+        if (used < 0) {
+            return false;
+        }
+        if (used < rest) {
+            u->m_keep_alive = false;
+        }
+        append(u, u->m_head + head_end, used);
+    }
+
+    return true;
+}
+
+bool Proxy::pump(UpstreamConn *u) {
+    HTTPConn *conn = u->m_client;
+    int client_fd = conn->m_sock_fd;
+    u->m_state = UPSTREAM_BODY;
+
+    while (true) {
+        while (u->m_buf_sent < u->m_buf_len) {
+            struct iovec iv = { u->m_buf + u->m_buf_sent, (size_t)(u->m_buf_len - u->m_buf_sent) };
+            ssize_t n = conn->send_iov(&iv, 1);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    conn->arm(EPOLLOUT);
+                    return true;
+                }
+                release(u, false);
+                return false;
+            }
+            u->m_buf_sent += n;
+        }
+        u->m_buf_len = 0;
+        u->m_buf_sent = 0;
+
+        while (u->m_pipe_len > 0) {
+            ssize_t n = splice(u->m_pipe[0], NULL, client_fd, NULL, u->m_pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    conn->arm(EPOLLOUT);
+                    return true;
+                }
+                release(u, false);
+                return false;
+            }
+            u->m_pipe_len -= n;
+        }
+
+        if (u->m_body_done) {
+            return finish(u);
+        }
+
+        ssize_t n = 0;
+        // splice only when the kernel does the encryption, if any
+        bool spliced = u->m_body_mode == BODY_LENGTH && u->m_splice && conn->raw_send() && u->open_pipe();
+        if (spliced) {
+            long want = (u->m_body_left < SPLICE_CHUNK) ? u->m_body_left : SPLICE_CHUNK;
+            n = splice(u->m_fd, NULL, u->m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                u->m_pipe_len += n;
+                u->m_body_left -= n;
+                if (u->m_body_left == 0) {
+                    u->m_body_done = true;
+                }
+                continue;
+            }
+        } else {
+            n = recv(u->m_fd, u->m_buf, RELAY_BUFFER_SIZE, 0);
+            if (n > 0) {
+                int used = u->consume(u->m_buf, n);
+                if (used < 0) {
+                    u->m_upstream->mark_failed(time(NULL));
+                    release(u, false);
+                    return false;
+                }
+                if (used < n) {
+                    u->m_keep_alive = false;
+                }
+                u->m_buf_len = used;
+                continue;
+            }
+        }
+
+        if (n == 0) {
+            if (u->m_body_mode == BODY_EOF) {
+                u->m_body_done = true;
+                continue;
+            }
+            // truncated response, the client can only learn it by the close
+            u->m_upstream->mark_failed(time(NULL));
+            release(u, false);
+            return false;
+        }
+
+        if (errno == EAGAIN) {
+            mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLIN);
+            return true;
+        }
+        if (spliced && errno == EINVAL) {
+            // socket type without splice support, fall back to copying
+            u->m_splice = false;
+            continue;
+        }
+
+        u->m_upstream->mark_failed(time(NULL));
+        release(u, false);
+        return false;
+    }
+}
+
+bool Proxy::retry(UpstreamConn *u) {
+    HTTPConn *conn = u->m_client;
+    release(u, false);
+    return start(conn, true);
+}
+
+bool Proxy::finish(UpstreamConn *u) {
+    HTTPConn *conn = u->m_client;
+    u->m_upstream->mark_ok();
+    release(u, u->m_keep_alive);
+
+    if (!conn->m_linger) {
+        return false;
+    }
+    conn->init();
+    conn->m_idle = true;
+    conn->arm(EPOLLIN);
+    return true;
+}
+
+// nothing reached the client yet, so it still gets a proper response
+bool Proxy::fail(UpstreamConn *u) {
+    HTTPConn *conn = u->m_client;
+    bool connecting = (u->m_state == UPSTREAM_CONNECTING);
+    u->m_upstream->mark_failed(time(NULL));
+    release(u, false);
+    if (connecting) {
+        return start(conn, true);
+    }
+    return bad_gateway(conn);
+}
+
+bool Proxy::bad_gateway(HTTPConn *conn) {
+    conn->m_proxy_route = NULL;
+    conn->m_write_idx = 0;
+    if (!conn->process_write(BAD_GATEWAY)) {
+        return false;
+    }
+    return conn->write();
+}
+
+void Proxy::release(UpstreamConn *u, bool reuse) {
+    Upstream *upstream = u->m_upstream;
+    if (u->m_client) {
+        u->m_client->m_upstream = NULL;
+        u->m_client = NULL;
+        upstream->m_outstanding--;
+    }
+
+    if (reuse && upstream->put_idle(u->m_fd)) {
+        u->m_state = UPSTREAM_IDLE;
+        mod_fd(HTTPConn::m_epoll_fd, u->m_fd, EPOLLIN);
+        return;
+    }
+
+    m_conns[u->m_fd] = NULL;
+    remove_fd(HTTPConn::m_epoll_fd, u->m_fd);
+    delete u;
+}
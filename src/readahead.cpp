@@ -0,0 +1,198 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "readahead.h"
+
+// seconds are enough for counts that decay by the minute
+static time_t coarse_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+    class LargeFiles
+*/
+
+LargeFiles::LargeFiles() {
+    m_threshold = LARGE_FILE_SIZE;
+    m_keep_hits = KEEP_CACHED_HITS;
+    m_streamed = 0;
+    m_kept = 0;
+}
+
+void LargeFiles::configure(off_t threshold, int keep_hits) {
+    m_threshold = threshold;
+    m_keep_hits = keep_hits;
+}
+
+void LargeFiles::decay(Entry *entry, time_t now) {
+    long periods = (now - entry->stamp) / LARGE_FILE_DECAY;
+    if (periods > 0) {
+        entry->hits = (periods >= 31) ? 0 : entry->hits >> periods;
+        entry->stamp += periods * LARGE_FILE_DECAY;
+    }
+}
+
+// the lock is held
+LargeFiles::Entry *LargeFiles::find(dev_t dev, ino_t ino) {
+    for (size_t i = 0; i < m_table.size(); i++) {
+        if (m_table[i].dev == dev && m_table[i].ino == ino) {
+            return &m_table[i];
+        }
+    }
+    return NULL;
+}
+
+bool LargeFiles::hit(const struct stat &st) {
+    time_t now = coarse_now();
+    m_lock.lock();
+    Entry *entry = NULL;
+    Entry *coldest = NULL;
+    for (size_t i = 0; i < m_table.size(); i++) {
+        Entry *e = &m_table[i];
+        decay(e, now);
+        if (e->dev == st.st_dev && e->ino == st.st_ino) {
+            entry = e;
+            break;
+        }
+        if (e->readers == 0 && (!coldest || e->hits < coldest->hits)) {
+            coldest = e;
+        }
+    }
+
+    // a full table gives the least requested idle slot to the new file,
+    // one where every file is being streamed grows
+    if (!entry) {
+        Entry fresh = {st.st_dev, st.st_ino, 0, 0, now};
+        if (m_table.size() < LARGE_FILE_TABLE || !coldest) {
+            m_table.push_back(fresh);
+            entry = &m_table.back();
+        } else {
+            *coldest = fresh;
+            entry = coldest;
+        }
+    }
+
+    entry->hits++;
+    entry->readers++;
+    bool keep = m_keep_hits > 0 && entry->hits >= m_keep_hits;
+    m_streamed++;
+    m_kept += keep;
+    m_lock.unlock();
+    return keep;
+}
+
+bool LargeFiles::shared(dev_t dev, ino_t ino) {
+    m_lock.lock();
+    Entry *entry = find(dev, ino);
+    bool others = entry && entry->readers > 1;
+    m_lock.unlock();
+    return others;
+}
+
+bool LargeFiles::leave(dev_t dev, ino_t ino) {
+    m_lock.lock();
+    Entry *entry = find(dev, ino);
+    if (entry && entry->readers > 0) {
+        entry->readers--;
+    }
+    bool others = entry && entry->readers > 0;
+    m_lock.unlock();
+    return others;
+}
+
+void LargeFiles::report() {
+    if (m_threshold == 0) {
+        return;
+    }
+    m_lock.lock();
+    printf("*) large files: %ld streamed, %ld kept cached, %zu tracked\n", m_streamed, m_kept, m_table.size());
+    m_lock.unlock();
+}
+
+/*
+    class ReadAhead
+*/
+
+ReadAhead::ReadAhead() {
+    files = NULL;
+    sendfile = false;
+    m_fd = -1;
+    stop();
+}
+
+ReadAhead::~ReadAhead() {
+    stop();
+}
+
+void ReadAhead::start(int fd, const struct stat &st) {
+    stop();
+    m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (m_fd < 0) {
+        return;
+    }
+    m_dev = st.st_dev;
+    m_ino = st.st_ino;
+    m_size = st.st_size;
+    m_keep = files->hit(st);
+    m_window = READAHEAD_MIN;
+    m_issued = coarse_now();
+
+    // a larger kernel readahead for this open file, and the first window now
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    m_ahead = (m_size < m_window) ? m_size : m_window;
+    posix_fadvise(m_fd, 0, m_ahead, POSIX_FADV_WILLNEED);
+}
+
+void ReadAhead::advance(off_t pos, char *mapping) {
+    if (m_fd < 0) {
+        return;
+    }
+
+    // halfway into the window, the next one is asked for
+    if (m_ahead < m_size && pos + m_window / 2 >= m_ahead) {
+        time_t now = coarse_now();
+        if (now - m_issued <= 1) {
+            m_window = (m_window * 2 > READAHEAD_MAX) ? READAHEAD_MAX : m_window * 2;
+        } else if (now - m_issued > 4) {
+            m_window = (m_window / 2 < READAHEAD_MIN) ? READAHEAD_MIN : m_window / 2;
+        }
+        off_t len = (m_size - m_ahead < m_window) ? m_size - m_ahead : m_window;
+        posix_fadvise(m_fd, m_ahead, len, POSIX_FADV_WILLNEED);
+        m_ahead += len;
+        m_issued = now;
+    }
+
+    // the page cache only lets go of pages nobody maps, ours go first
+    off_t end = (pos - DROP_BEHIND_LAG) & ~(off_t)(DROP_BEHIND_ALIGN - 1);
+    // a reader further back still needs them, the last one out drops them
+    if (!m_keep && end > m_behind && !files->shared(m_dev, m_ino)) {
+        if (mapping) {
+            madvise(mapping + m_behind, end - m_behind, MADV_DONTNEED);
+        }
+        posix_fadvise(m_fd, m_behind, end - m_behind, POSIX_FADV_DONTNEED);
+        m_behind = end;
+    }
+}
+
+// after the mapping is gone, or the pages it still maps stay cached
+void ReadAhead::stop() {
+    if (m_fd >= 0) {
+        // only what this response read in, and only when nobody else streams the file
+        bool others = files->leave(m_dev, m_ino);
+        if (!m_keep && !others && m_ahead > m_behind) {
+            posix_fadvise(m_fd, m_behind, m_ahead - m_behind, POSIX_FADV_DONTNEED);
+        }
+        close(m_fd);
+    }
+    m_fd = -1;
+    m_size = 0;
+    m_ahead = 0;
+    m_behind = 0;
+    m_window = READAHEAD_MIN;
+    m_issued = 0;
+    m_keep = false;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "http.h"
+#include "scheduler.h"
+
+// a bucket holds WRITE_BURST_MS of its rate, at least one TLS record
+static long burst(long rate) {
+    long size = rate * WRITE_BURST_MS / 1000;
+    return (size < (16 << 10)) ? (16 << 10) : size;
+}
+
+static void refill(long *tokens, long *refilled_ms, long rate, long now) {
+    long elapsed = now - *refilled_ms;
+    if (elapsed <= 0) {
+        return;
+    }
+    *tokens += rate * elapsed / 1000;
+    if (*tokens > burst(rate)) {
+        *tokens = burst(rate);
+    }
+    *refilled_ms = now;
+}
+
+int clamp_iov(const struct iovec *in, int count, long budget, struct iovec *out) {
+    int n = 0;
+    for (; n < count && budget > 0; n++) {
+        out[n] = in[n];
+        if ((long)out[n].iov_len > budget) {
+            out[n].iov_len = budget;
+        }
+        budget -= out[n].iov_len;
+    }
+    return n;
+}
+
+/*
+    class WriteScheduler
+*/
+
+WriteScheduler::WriteScheduler() {
+    m_quantum = WRITE_QUANTUM;
+    m_conn_rate = 0;
+    m_global_rate = 0;
+    m_tokens = 0;
+    m_refilled_ms = now_ms();
+    m_ticked_ms = m_refilled_ms;
+    m_bytes = 0;
+    m_yields = 0;
+    m_stalls = 0;
+}
+
+WriteScheduler::~WriteScheduler() {}
+
+void WriteScheduler::configure(long quantum, long conn_rate, long global_rate) {
+    if (quantum > 0) {
+        m_quantum = quantum;
+    }
+    m_conn_rate = conn_rate;
+    m_global_rate = global_rate;
+    m_tokens = global_rate ? burst(global_rate) : 0;
+}
+
+void WriteScheduler::reset(WriteState *state) {
+    state->deficit = 0;
+    state->tokens = m_conn_rate ? burst(m_conn_rate) : 0;
+    state->refilled_ms = now_ms();
+    state->parked = false;
+}
+
+long WriteScheduler::grant(WriteState *state) {
+    // credit left from a turn cut short carries over, once
+    state->deficit += m_quantum;
+    if (state->deficit > 2 * m_quantum) {
+        state->deficit = 2 * m_quantum;
+    }
+
+    long budget = state->deficit;
+    if (m_conn_rate || m_global_rate) {
+        long now = now_ms();
+        if (m_conn_rate) {
+            refill(&state->tokens, &state->refilled_ms, m_conn_rate, now);
+            budget = (state->tokens < budget) ? state->tokens : budget;
+        }
+        if (m_global_rate) {
+            refill(&m_tokens, &m_refilled_ms, m_global_rate, now);
+            budget = (m_tokens < budget) ? m_tokens : budget;
+        }
+    }
+    return (budget > 0) ? budget : 0;
+}
+
+void WriteScheduler::charge(WriteState *state, long bytes) {
+    state->deficit -= bytes;
+    if (m_conn_rate) {
+        state->tokens -= bytes;
+    }
+    if (m_global_rate) {
+        m_tokens -= bytes;
+    }
+    m_bytes += bytes;
+}
+
+void WriteScheduler::finish(WriteState *state) {
+    state->deficit = 0;
+}
+
+void WriteScheduler::park(HTTPConn *conn, WriteState *state) {
+    if (state->parked) {
+        return;
+    }
+    m_lock.lock();
+    state->parked = true;
+    m_parked.push_back(conn);
+    m_lock.unlock();
+    m_stalls++;
+}
+
+void WriteScheduler::forget(HTTPConn *conn, WriteState *state) {
+    m_lock.lock();
+    if (state->parked) {
+        state->parked = false;
+        for (size_t i = 0; i < m_parked.size(); i++) {
+            if (m_parked[i] == conn) {
+                m_parked[i] = m_parked.back();
+                m_parked.pop_back();
+                break;
+            }
+        }
+    }
+    m_lock.unlock();
+}
+
+// resume() re-checks the owner, one closed after the swap is skipped there
+void WriteScheduler::tick() {
+    long now = now_ms();
+    if (now - m_ticked_ms < WRITE_TICK_MS) {
+        return;
+    }
+
+    std::vector<HTTPConn *> parked;
+    m_lock.lock();
+    parked.swap(m_parked);
+    m_lock.unlock();
+    if (parked.empty()) {
+        return;
+    }
+    m_ticked_ms = now;
+    for (size_t i = 0; i < parked.size(); i++) {
+        parked[i]->resume();
+    }
+}
+
+int WriteScheduler::timeout() const {
+    m_lock.lock();
+    bool empty = m_parked.empty();
+    m_lock.unlock();
+    return empty ? -1 : WRITE_TICK_MS;
+}
+
+void WriteScheduler::report() const {
+    printf("*) writes: %llu bytes, %lu yields, %lu stalls\n", m_bytes, m_yields, m_stalls);
+}
+
+// coarse is enough for buckets refilled every WRITE_TICK_MS
+long WriteScheduler::now_ms() const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
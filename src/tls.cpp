@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tls.h"
+
+// h2 when the client offers it and we take it, the preface then switches the connection
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    // skips the "h2" entry
+    int from = *(const bool *)arg ? 0 : 3;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos + from, sizeof(protos) - 1 - from, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+    class TLSContext
+*/
+
+TLSContext::TLSContext() {
+    m_ctx = NULL;
+    m_h2 = true;
+}
+
+TLSContext::~TLSContext() {
+    if (m_ctx) {
+        SSL_CTX_free(m_ctx);
+    }
+}
+
+bool TLSContext::load(const char *cert, const char *key) {
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (!m_ctx) {
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+
+    // OpenSSL installs the record keys into the kernel (TCP_ULP "tls") once
+    // the handshake is done, plain writev/splice on the socket then stay valid
+    SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // AEAD suites the kernel can offload go first
+    SSL_CTX_set_cipher_list(m_ctx, "ECDHE+AESGCM:ECDHE+CHACHA20:!aNULL");
+    SSL_CTX_set_ciphersuites(m_ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+
+    // resumption by session id cache and by tickets, both skip the key exchange
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(m_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(m_ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(m_ctx, (const unsigned char *)"xhttpd", 6);
+    SSL_CTX_set_num_tickets(m_ctx, TLS_TICKETS);
+
+    SSL_CTX_set_alpn_select_cb(m_ctx, select_alpn, &m_h2);
+
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(m_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(m_ctx) != 1) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(m_ctx);
+        m_ctx = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+SSL *TLSContext::accept(int fd) {
+    SSL *ssl = SSL_new(m_ctx);
+    if (!ssl) {
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+// 1 when done, 0 to be called again on readiness, -1 on failure
+int tls_handshake(SSL *ssl, bool &want_write) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1) {
+        return 1;
+    }
+
+    int err = SSL_get_error(ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        want_write = (err == SSL_ERROR_WANT_WRITE);
+        return 0;
+    }
+    return -1;
+}
+
+ssize_t tls_recv(SSL *ssl, char *buf, size_t len) {
+    ERR_clear_error();
+    int n = SSL_read(ssl, buf, (len > INT_MAX) ? INT_MAX : len);
+    if (n > 0) {
+        return n;
+    }
+
+    switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        errno = EIO;
+        return -1;
+    }
+}
+
+/*
+    User space fallback when the kernel did not take the keys. Small pieces
+    are gathered so every record is filled, larger ones are encrypted in
+    place. OpenSSL wants a write it could not finish retried with the same
+    length, so its length is kept in pending and the retry, from the same
+    iovec position, offers exactly that much first. The scheduler may
+    grant less meanwhile, HTTPConn::send_budget() widens the turn for it.
+*/
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int count, int *pending) {
+    char record[TLS_RECORD_SIZE];
+    ssize_t total = 0;
+    size_t offset = 0;
+    int i = 0;
+
+    while (i < count && iov[i].iov_len == 0)
+        i++;
+
+    while (i < count) {
+        const char *data;
+        int len = 0;
+        int limit = *pending ? *pending : TLS_RECORD_SIZE;
+
+        if (iov[i].iov_len - offset >= (size_t)limit) {
+            data = (const char *)iov[i].iov_base + offset;
+            len = limit;
+        } else {
+            size_t from = offset;
+            for (int j = i; j < count && len < limit; j++, from = 0) {
+                size_t n = iov[j].iov_len - from;
+                if (n > (size_t)(limit - len)) {
+                    n = limit - len;
+                }
+                memcpy(record + len, (const char *)iov[j].iov_base + from, n);
+                len += n;
+            }
+            data = record;
+        }
+
+        ERR_clear_error();
+        int n = SSL_write(ssl, data, len);
+        if (n <= 0) {
+            int err = SSL_get_error(ssl, n);
+            bool again = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ);
+            if (again) {
+                *pending = len;
+            }
+            if (total > 0) {
+                return total;
+            }
+            errno = again ? EAGAIN : EPIPE;
+            return -1;
+        }
+
+        *pending = 0;
+        total += n;
+        size_t advance = n;
+        while (i < count && advance >= iov[i].iov_len - offset) {
+            advance -= iov[i].iov_len - offset;
+            offset = 0;
+            i++;
+        }
+        offset += advance;
+    }
+
+    return total;
+}
+
+bool tls_ktls_send(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+bool tls_ktls_recv(SSL *ssl) {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// what a request spends from one boundary to the next
+static const char *stage_names[STAGE_COUNT] = {"read", "queue", "parse", "resolve", "respond", "write", "done"};
+
+static void put_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(fp, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*
+    class Timeline
+*/
+
+Timeline::Timeline() {
+    m_path[0] = 0;
+    m_rate = 0;
+    m_requests = 0;
+    m_head = 0;
+    m_slots = NULL;
+}
+
+Timeline::~Timeline() {
+    delete[] m_slots;
+}
+
+void Timeline::configure(const char *path, int rate) {
+    strncpy(m_path, path, sizeof(m_path) - 1);
+    m_path[sizeof(m_path) - 1] = 0;
+    m_rate = rate;
+    if (!m_slots) {
+        m_slots = new Slot[TRACE_RING_SIZE];
+        for (int i = 0; i < TRACE_RING_SIZE; i++) {
+            m_slots[i].seq.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Timeline::sample(uint64_t *id) {
+    uint64_t n = m_requests.fetch_add(1, std::memory_order_relaxed);
+    if (n % m_rate != 0) {
+        return false;
+    }
+    *id = n / m_rate;
+    return true;
+}
+
+void Timeline::commit(const TraceSpan &span) {
+    uint64_t index = m_head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = m_slots[index % TRACE_RING_SIZE];
+    slot.seq.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.span = span;
+    slot.seq.store(index * 2 + 2, std::memory_order_release);
+}
+
+bool Timeline::dump() {
+    if (!enabled()) {
+        return true;
+    }
+
+    // written aside and renamed like the warm-up manifest
+    char tmp[sizeof(m_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m_path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        return false;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"xhttpd\"}}", getpid());
+    int count = 0;
+    for (int i = 0; i < TRACE_RING_SIZE; i++) {
+        Slot &slot = m_slots[i];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq == 0 || (seq & 1)) {
+            continue;
+        }
+        TraceSpan span = slot.span;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq || !span.ts[STAGE_DONE]) {
+            continue;
+        }
+
+        // one row per connection, the request on top of its stages
+        fprintf(fp, ",\n{\"name\":");
+        put_json_string(fp, span.url);
+        fprintf(fp, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,",
+                (unsigned long long)span.ts[STAGE_READ], (unsigned long long)(span.ts[STAGE_DONE] - span.ts[STAGE_READ]),
+                getpid(), span.fd);
+        fprintf(fp, "\"args\":{\"id\":%llu,\"code\":%d,\"bytes\":%ld,\"stalls\":%d}}", (unsigned long long)span.id,
+                span.code, span.bytes, span.stalls);
+
+        int from = STAGE_READ;
+        for (int stage = STAGE_QUEUED; stage < STAGE_COUNT; stage++) {
+            if (!span.ts[stage]) {
+                continue;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d}",
+                    stage_names[from], (unsigned long long)span.ts[from],
+                    (unsigned long long)(span.ts[stage] - span.ts[from]), getpid(), span.fd);
+            from = stage;
+        }
+        count++;
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0 || rename(tmp, m_path) < 0) {
+        unlink(tmp);
+        return false;
+    }
+    printf("*) %d sampled requests traced to %s\n", count, m_path);
+    return true;
+}
+
+// the vDSO clock, only read for sampled requests
+uint64_t Timeline::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,209 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vhost.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// FNV-1a from the last byte back, so the hash of every suffix is on the way
+static uint64_t hash_step(uint64_t hash, char c) {
+    return (hash ^ (unsigned char)tolower((unsigned char)c)) * FNV_PRIME;
+}
+
+static uint64_t hash_name(const char *name, int len) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = len - 1; i >= 0; i--) {
+        hash = hash_step(hash, name[i]);
+    }
+    return hash;
+}
+
+// the host part of a Host header, "[v6]:port" keeps its brackets
+static int host_length(const char *host) {
+    int len = 0;
+    if (host[0] == '[') {
+        const char *end = strchr(host, ']');
+        len = end ? end - host + 1 : strlen(host);
+    } else {
+        len = strcspn(host, ": \t");
+    }
+    while (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    return len;
+}
+
+/*
+    class VirtualHosts
+*/
+
+VirtualHosts::VirtualHosts() {
+    m_mask = 0;
+}
+
+VirtualHosts::~VirtualHosts() {
+    for (size_t i = 0; i < m_sites.size(); i++) {
+        if (m_sites[i]->root_fd >= 0) {
+            close(m_sites[i]->root_fd);
+        }
+        delete m_sites[i];
+    }
+}
+
+// "example.com,*.example.com=/srv/example;Cache-Control: max-age=60"
+bool VirtualHosts::add(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec) {
+        return false;
+    }
+    const char *target = eq + 1;
+    const char *end = strchr(target, ';');
+    int target_len = end ? end - target : strlen(target);
+    if (target_len == 0 || target_len >= SITE_ROOT_LEN) {
+        return false;
+    }
+
+    Site *site = new Site;
+    site->root_fd = -1;
+    memcpy(site->doc_root, target, target_len);
+    site->doc_root[target_len] = 0;
+    int name_len = eq - spec;
+    snprintf(site->name, sizeof(site->name), "%.*s", name_len, spec);
+
+    // headers go out as given on HTTP/1.1 and lowercased on HTTP/2
+    while (end) {
+        const char *line = end + 1;
+        end = strchr(line, ';');
+        std::string header(line, end ? end - line : strlen(line));
+        size_t colon = header.find(':');
+        if (colon == std::string::npos || colon == 0 || header.find_first_of("\r\n") != std::string::npos) {
+            delete site;
+            return false;
+        }
+        std::string name = header.substr(0, colon);
+        size_t start = header.find_first_not_of(" \t", colon + 1);
+        std::string value = (start == std::string::npos) ? "" : header.substr(start);
+        site->head += name + ": " + value + "\r\n";
+        for (size_t i = 0; i < name.size(); i++) {
+            name[i] = tolower((unsigned char)name[i]);
+        }
+        site->headers.push_back(std::make_pair(name, value));
+    }
+
+    // "*.example.com" is kept as ".example.com"
+    int index = m_sites.size();
+    char names[HOST_NAME_LEN];
+    snprintf(names, sizeof(names), "%.*s", name_len, spec);
+    char *save = NULL;
+    for (char *name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (name[0] == '*' && name[1] == '.') {
+            name++;
+        }
+        int len = host_length(name);
+        if (len == 0 || len != (int)strlen(name) || strchr(name, '*')) {
+            delete site;
+            return false;
+        }
+        std::string key(name, len);
+        for (size_t i = 0; i < key.size(); i++) {
+            key[i] = tolower((unsigned char)key[i]);
+        }
+        m_names.push_back(std::make_pair(key, index));
+    }
+    m_sites.push_back(site);
+    return true;
+}
+
+bool VirtualHosts::open() {
+    if (m_sites.empty()) {
+        return true;
+    }
+
+    for (size_t i = 0; i < m_sites.size(); i++) {
+        Site *site = m_sites[i];
+        if (strncmp(site->doc_root, "bundle:", 7) == 0) {
+            if (!site->bundles.load(site->doc_root + 7)) {
+                return false;
+            }
+            continue;
+        }
+        site->root_fd = ::open(site->doc_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (site->root_fd < 0) {
+            printf("error: cannot open %s for %s\n", site->doc_root, site->name);
+            return false;
+        }
+    }
+
+    // at most half full, a miss ends at the first empty slot
+    size_t size = 16;
+    while (size < m_names.size() * 2) {
+        size <<= 1;
+    }
+    Slot empty = {0, 0, 0, -1};
+    m_table.assign(size, empty);
+    m_mask = size - 1;
+    for (size_t i = 0; i < m_names.size(); i++) {
+        const std::string &key = m_names[i].first;
+        uint64_t hash = hash_name(key.data(), key.size());
+        if (probe(key.data(), key.size(), hash)) {
+            printf("error: host %s is named twice\n", key.c_str());
+            return false;
+        }
+        size_t pos = hash & m_mask;
+        while (m_table[pos].site >= 0) {
+            pos = (pos + 1) & m_mask;
+        }
+        Slot slot = {hash, (uint32_t)m_arena.size(), (uint16_t)key.size(), (int16_t)m_names[i].second};
+        m_table[pos] = slot;
+        m_arena += key;
+    }
+
+    printf("*) %zu virtual hosts under %zu names\n", m_sites.size(), m_names.size());
+    return true;
+}
+
+Site *VirtualHosts::probe(const char *host, int len, uint64_t hash) const {
+    for (size_t pos = hash & m_mask; m_table[pos].site >= 0; pos = (pos + 1) & m_mask) {
+        const Slot &slot = m_table[pos];
+        if (slot.hash == hash && slot.len == len && strncasecmp(m_arena.data() + slot.name, host, len) == 0) {
+            return m_sites[slot.site];
+        }
+    }
+    return NULL;
+}
+
+Site *VirtualHosts::find(const char *host) const {
+    if (!host || m_table.empty()) {
+        return NULL;
+    }
+    int len = host_length(host);
+    if (len == 0 || len >= HOST_NAME_LEN) {
+        return NULL;
+    }
+
+    // suffixes come shortest first, the longest wildcard match is kept
+    Site *suffix = NULL;
+    uint64_t hash = FNV_OFFSET;
+    for (int i = len - 1; i >= 0; i--) {
+        hash = hash_step(hash, host[i]);
+        if (host[i] == '.' && i > 0) {
+            Site *site = probe(host + i, len - i, hash);
+            suffix = site ? site : suffix;
+        }
+    }
+    Site *exact = probe(host, len, hash);
+    return exact ? exact : suffix;
+}
+
+void VirtualHosts::reload() {
+    for (size_t i = 0; i < m_sites.size(); i++) {
+        if (m_sites[i]->bundles.enabled()) {
+            m_sites[i]->bundles.reload();
+        }
+    }
+}
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <math.h>
+
+#include "http.h"
+#include "warm.h"
+
+static long elapsed_ms(const struct timespec &since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/*
+    class Warmer
+*/
+
+Warmer::Warmer() {
+    m_root_fd = -1;
+    m_bundles = NULL;
+    m_next = 0;
+    m_done = 0;
+    m_bytes = 0;
+}
+
+Warmer::~Warmer() {}
+
+// one URL path per line, hottest first, as AccessRecorder writes it
+bool Warmer::load(const char *manifest) {
+    FILE *fp = fopen(manifest, "r");
+    if (!fp) {
+        return false;
+    }
+
+    char line[FILENAME_LEN + 2];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '/') {
+            m_paths.push_back(line);
+        }
+    }
+    fclose(fp);
+
+    printf("*) warm-up manifest %s with %zu paths\n", manifest, m_paths.size());
+    return true;
+}
+
+void Warmer::start(int root_fd, BundleStore *bundles) {
+    m_root_fd = root_fd;
+    m_bundles = bundles;
+    clock_gettime(CLOCK_MONOTONIC, &m_started);
+
+    size_t threads = std::min((size_t)WARM_THREADS, m_paths.size());
+    for (size_t i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, this) == 0) {
+            pthread_detach(tid);
+        }
+    }
+}
+
+void *Warmer::worker(void *arg) {
+    Warmer *warmer = (Warmer *)arg;
+    warmer->run();
+    return warmer;
+}
+
+void Warmer::run() {
+    while (true) {
+        m_lock.lock();
+        size_t i = m_next++;
+        m_lock.unlock();
+        if (i >= m_paths.size()) {
+            break;
+        }
+
+        warm(m_paths[i].c_str());
+
+        m_lock.lock();
+        bool last = (++m_done == m_paths.size());
+        m_lock.unlock();
+        if (last) {
+            printf("*) warm-up finished in %ld ms\n", elapsed_ms(m_started));
+        }
+    }
+}
+
+// the same resolution a request does, then readahead of the body
+void Warmer::warm(const char *url) {
+    char path[FILENAME_LEN];
+    if (!normalize_url(url, path, sizeof(path))) {
+        return;
+    }
+
+    long long bytes = 0;
+    if (m_bundles->enabled()) {
+        // every variant, a miss on one encoding falls back to identity
+        for (int i = BUNDLE_IDENTITY; i < BUNDLE_ENCODINGS; i++) {
+            BundleFile file;
+            if (!m_bundles->lookup(path, (i == BUNDLE_IDENTITY) ? 0 : (1 << i), &file)) {
+                return;
+            }
+            if (i == BUNDLE_IDENTITY || file.encoding) {
+                readahead(file.bundle->fd(), file.offset, file.size);
+                bytes += file.size;
+            }
+            file.bundle->unref();
+        }
+    } else {
+        int fd = open_beneath(m_root_fd, path);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            readahead(fd, 0, st.st_size);
+            bytes = st.st_size;
+        }
+        close(fd);
+    }
+
+    m_lock.lock();
+    m_bytes += bytes;
+    m_lock.unlock();
+}
+
+void Warmer::wait(double fraction) {
+    size_t total = m_paths.size();
+    size_t target = (size_t)ceil(total * fraction);
+    if (target > total) {
+        target = total;
+    }
+
+    long reported = 0;
+    while (true) {
+        m_lock.lock();
+        size_t done = m_done;
+        long long bytes = m_bytes;
+        m_lock.unlock();
+
+        long ms = elapsed_ms(m_started);
+        if (done >= target) {
+            printf("*) ready after %ld ms, %zu/%zu paths warm\n", ms, done, total);
+            return;
+        }
+        if (ms - reported >= WARM_PROGRESS_MS) {
+            reported = ms;
+            printf("*) warm-up %zu/%zu paths, %lld KB\n", done, total, bytes >> 10);
+        }
+        usleep(WARM_POLL_MS * 1000);
+    }
+}
+
+/*
+    class AccessRecorder
+*/
+
+AccessRecorder::AccessRecorder() {
+    m_manifest[0] = 0;
+    m_dirty = false;
+    m_last_dump = 0;
+}
+
+AccessRecorder::~AccessRecorder() {}
+
+void AccessRecorder::open(const char *manifest) {
+    strncpy(m_manifest, manifest, sizeof(m_manifest) - 1);
+    m_manifest[sizeof(m_manifest) - 1] = 0;
+    m_last_dump = time(NULL);
+}
+
+void AccessRecorder::hit(const char *url) {
+    std::string path(url, strcspn(url, "?#"));
+    m_lock.lock();
+    m_hits[path]++;
+    m_dirty = true;
+    m_lock.unlock();
+}
+
+static bool hotter(const std::pair<std::string, unsigned long> &a, const std::pair<std::string, unsigned long> &b) {
+    return a.second > b.second;
+}
+
+bool AccessRecorder::dump() {
+    m_lock.lock();
+    if (!m_dirty) {
+        m_lock.unlock();
+        return true;
+    }
+    std::vector<std::pair<std::string, unsigned long> > hits(m_hits.begin(), m_hits.end());
+    m_dirty = false;
+    m_lock.unlock();
+
+    std::stable_sort(hits.begin(), hits.end(), hotter);
+
+    // written aside and renamed, a starting server never reads half of it
+    std::string tmp = std::string(m_manifest) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+    for (size_t i = 0; i < hits.size(); i++) {
+        fprintf(fp, "%s\n", hits[i].first.c_str());
+    }
+    if (fclose(fp) != 0 || rename(tmp.c_str(), m_manifest) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void AccessRecorder::tick() {
+    time_t now = time(NULL);
+    if (now - m_last_dump >= WARM_RECORD_INTERVAL) {
+        m_last_dump = now;
+        dump();
+    }
+}
@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "bundle.h"
+#include "mime.h"
+
+// packs a doc_root tree into one bundle file for xhttpd --bundle
+
+struct Item {
+    std::string path;
+    std::string file;
+    off_t size;
+    time_t mtime;
+    int variant[BUNDLE_ENCODINGS];
+    BundleEntry entry;
+};
+
+static std::vector<Item> items;
+static size_t root_len;
+
+static int collect(const char *file, const struct stat *st, int flag, struct FTW *ftw) {
+    // symlinks are not followed, the bundle only holds what is under the root
+    if (flag != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    Item item;
+    item.file = file;
+    item.path = file + root_len;
+    item.size = st->st_size;
+    item.mtime = st->st_mtime;
+    for (int i = 0; i < BUNDLE_ENCODINGS; i++) {
+        item.variant[i] = -1;
+    }
+    if (item.path.size() >= BUNDLE_PATH_LEN) {
+        printf("skip %s: path too long\n", file);
+        return 0;
+    }
+    items.push_back(item);
+    return 0;
+}
+
+static bool by_path(const Item &a, const Item &b) {
+    return a.path < b.path;
+}
+
+static uint64_t align(uint64_t v, uint64_t to) {
+    return (v + to - 1) / to * to;
+}
+
+static uint32_t add_string(std::string &pool, const std::string &s) {
+    uint32_t offset = pool.size();
+    pool.append(s.c_str(), s.size() + 1);
+    return offset;
+}
+
+// content hash, stable across rebuilds of unchanged files
+static bool etag_of(const Item &item, std::string &etag) {
+    int fd = open(item.file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t h = 14695981039346656037ull;
+    char buf[64 << 10];
+    off_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ull;
+        }
+        total += n;
+    }
+    close(fd);
+    if (n < 0 || total != item.size) {
+        return false;
+    }
+
+    char value[0x20];
+    snprintf(value, sizeof(value), "\"%016llx\"", (unsigned long long)h);
+    etag = value;
+    return true;
+}
+
+// hash and displace, buckets with more keys are placed first
+static bool build_index(std::vector<uint32_t> &disp, std::vector<uint32_t> &slots, uint32_t nslots, uint32_t nbuckets) {
+    std::vector<uint64_t> hash(items.size());
+    std::vector<std::vector<uint32_t> > buckets(nbuckets);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        hash[i] = bundle_hash(items[i].path.c_str(), items[i].path.size());
+        buckets[hash[i] & (nbuckets - 1)].push_back(i);
+    }
+
+    std::vector<uint32_t> order(nbuckets);
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    disp.assign(nbuckets, 0);
+    slots.assign(nslots, 0);
+    for (uint32_t k = 0; k < nbuckets; k++) {
+        const std::vector<uint32_t> &keys = buckets[order[k]];
+        if (keys.empty()) {
+            break;
+        }
+
+        uint32_t d = 0;
+        for (; d < (1 << 20); d++) {
+            size_t placed = 0;
+            for (; placed < keys.size(); placed++) {
+                uint32_t s = bundle_slot(hash[keys[placed]], d, nslots);
+                if (slots[s]) {
+                    break;
+                }
+                slots[s] = keys[placed] + 1;
+            }
+            if (placed == keys.size()) {
+                break;
+            }
+            while (placed-- > 0) {
+                slots[bundle_slot(hash[keys[placed]], d, nslots)] = 0;
+            }
+        }
+        if (d == (1 << 20)) {
+            return false;
+        }
+        disp[order[k]] = d;
+    }
+    return true;
+}
+
+static bool copy_body(int in, int out, off_t offset, off_t size) {
+    loff_t off_out = offset;
+    while (size > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, &off_out, size, 0);
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+    }
+
+    // filesystems without copy_file_range take the slow way
+    char buf[64 << 10];
+    while (size > 0) {
+        ssize_t n = read(in, buf, (size < (off_t)sizeof(buf)) ? size : sizeof(buf));
+        if (n <= 0 || pwrite(out, buf, n, off_out) != n) {
+            return false;
+        }
+        off_out += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+    return pwrite(fd, data, len, offset) == (ssize_t)len;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-m mime.types] <dir> <bundle>\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt == 'm' && mime_load(optarg)) {
+            continue;
+        }
+        usage(name);
+        return 1;
+    }
+    if (argc - optind != 2) {
+        usage(name);
+        return 1;
+    }
+
+    std::string root = argv[optind];
+    const char *out = argv[optind + 1];
+    while (root.size() > 1 && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+    root_len = root.size() + 1;
+
+    if (nftw(root.c_str(), collect, 64, FTW_PHYS) != 0) {
+        printf("error: cannot walk %s: %s\n", root.c_str(), strerror(errno));
+        return 1;
+    }
+    std::sort(items.begin(), items.end(), by_path);
+
+    // "x.gz" and "x.br" next to "x" are its precompressed variants
+    std::map<std::string, int> index;
+    for (size_t i = 0; i < items.size(); i++) {
+        index[items[i].path] = i;
+    }
+    const char *suffix[BUNDLE_ENCODINGS] = {NULL, ".gz", ".br"};
+    for (size_t i = 0; i < items.size(); i++) {
+        const std::string &path = items[i].path;
+        for (int e = BUNDLE_IDENTITY + 1; e < BUNDLE_ENCODINGS; e++) {
+            size_t len = strlen(suffix[e]);
+            if (path.size() > len && path.compare(path.size() - len, len, suffix[e]) == 0) {
+                std::map<std::string, int>::iterator it = index.find(path.substr(0, path.size() - len));
+                if (it != index.end()) {
+                    items[it->second].variant[e] = i;
+                }
+            }
+        }
+    }
+
+    uint32_t count = items.size();
+    uint32_t nslots = 2, nbuckets = 1;
+    while (nslots < count * 2) {
+        nslots <<= 1;
+    }
+    while (nbuckets * 4 < count) {
+        nbuckets <<= 1;
+    }
+
+    std::vector<uint32_t> disp, slots;
+    while (!build_index(disp, slots, nslots, nbuckets)) {
+        nslots <<= 1;
+    }
+
+    std::string strings(1, '\0');
+    for (size_t i = 0; i < items.size(); i++) {
+        Item &item = items[i];
+        std::string etag;
+        if (!etag_of(item, etag)) {
+            printf("error: cannot read %s\n", item.file.c_str());
+            return 1;
+        }
+
+        char date[0x40];
+        struct tm tm;
+        gmtime_r(&item.mtime, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+        memset(&item.entry, 0, sizeof(item.entry));
+        item.entry.path = add_string(strings, item.path);
+        item.entry.type = add_string(strings, mime_type(item.path.c_str()));
+        item.entry.body[BUNDLE_IDENTITY].etag = add_string(strings, etag);
+        item.entry.last_modified = add_string(strings, date);
+        item.entry.mtime = item.mtime;
+    }
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, 8);
+    header.version = BUNDLE_VERSION;
+    header.count = count;
+    header.buckets = nbuckets;
+    header.slots = nslots;
+    header.disp_offset = align(sizeof(header), 8);
+    header.slot_offset = align(header.disp_offset + nbuckets * sizeof(uint32_t), 8);
+    header.entry_offset = align(header.slot_offset + nslots * sizeof(uint32_t), 8);
+    header.string_offset = align(header.entry_offset + (uint64_t)count * sizeof(BundleEntry), 8);
+    header.string_size = strings.size();
+
+    // a body of a page or more starts on a page, smaller ones stay inside one
+    uint64_t pos = align(header.string_offset + header.string_size, BUNDLE_PAGE);
+    for (size_t i = 0; i < items.size(); i++) {
+        uint64_t size = items[i].size;
+        if (size >= BUNDLE_PAGE || pos % BUNDLE_PAGE + size > BUNDLE_PAGE) {
+            pos = align(pos, BUNDLE_PAGE);
+        }
+        items[i].entry.body[BUNDLE_IDENTITY].offset = pos;
+        items[i].entry.body[BUNDLE_IDENTITY].size = size;
+        pos += size;
+    }
+    header.size = pos;
+
+    for (size_t i = 0; i < items.size(); i++) {
+        for (int e = BUNDLE_IDENTITY + 1; e < BUNDLE_ENCODINGS; e++) {
+            if (items[i].variant[e] >= 0) {
+                items[i].entry.body[e] = items[items[i].variant[e]].entry.body[BUNDLE_IDENTITY];
+            }
+        }
+    }
+
+    // written aside and renamed, a running server never sees a partial file
+    std::string tmp = std::string(out) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, header.size) < 0) {
+        printf("error: cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+        return 1;
+    }
+
+    bool ok = pwrite_all(fd, &header, sizeof(header), 0) &&
+              pwrite_all(fd, disp.data(), disp.size() * sizeof(uint32_t), header.disp_offset) &&
+              pwrite_all(fd, slots.data(), slots.size() * sizeof(uint32_t), header.slot_offset) &&
+              pwrite_all(fd, strings.data(), strings.size(), header.string_offset);
+    for (size_t i = 0; ok && i < items.size(); i++) {
+        ok = pwrite_all(fd, &items[i].entry, sizeof(BundleEntry), header.entry_offset + i * sizeof(BundleEntry));
+        int in = open(items[i].file.c_str(), O_RDONLY);
+        ok = ok && in >= 0 && copy_body(in, fd, items[i].entry.body[BUNDLE_IDENTITY].offset, items[i].size);
+        if (in >= 0) {
+            close(in);
+        }
+    }
+
+    if (!ok || fsync(fd) < 0 || close(fd) < 0 || rename(tmp.c_str(), out) < 0) {
+        printf("error: cannot write %s: %s\n", out, strerror(errno));
+        unlink(tmp.c_str());
+        return 1;
+    }
+
+    printf("*) %s: %u files, %u slots, %llu bytes\n", out, count, nslots, (unsigned long long)header.size);
+    return 0;
+}